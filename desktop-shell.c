@@ -315,6 +315,7 @@ panel_launcher_enter_handler(struct widget *widget, struct input *input,
 	struct panel_launcher *launcher = data;
 
 	launcher->focused = 1;
+	widget_damage_region(widget, NULL);
 	widget_schedule_redraw(widget);
 
 	return CURSOR_LEFT_PTR;
@@ -328,6 +329,7 @@ panel_launcher_leave_handler(struct widget *widget,
 
 	launcher->focused = 0;
 	widget_destroy_tooltip(widget);
+	widget_damage_region(widget, NULL);
 	widget_schedule_redraw(widget);
 }
 
@@ -340,6 +342,7 @@ panel_launcher_button_handler(struct widget *widget,
 	struct panel_launcher *launcher;
 
 	launcher = widget_get_user_data(widget);
+	widget_damage_region(widget, NULL);
 	widget_schedule_redraw(widget);
 	if (state == WL_POINTER_BUTTON_STATE_RELEASED)
 		panel_launcher_activate(launcher);
@@ -355,6 +358,7 @@ panel_launcher_touch_down_handler(struct widget *widget, struct input *input,
 
 	launcher = widget_get_user_data(widget);
 	launcher->focused = 1;
+	widget_damage_region(widget, NULL);
 	widget_schedule_redraw(widget);
 }
 
@@ -367,6 +371,7 @@ panel_launcher_touch_up_handler(struct widget *widget, struct input *input,
 
 	launcher = widget_get_user_data(widget);
 	launcher->focused = 0;
+	widget_damage_region(widget, NULL);
 	widget_schedule_redraw(widget);
 	panel_launcher_activate(launcher);
 }
@@ -376,6 +381,7 @@ clock_func(struct toytimer *tt)
 {
 	struct panel_clock *clock = container_of(tt, struct panel_clock, timer);
 
+	widget_damage_region(clock->widget, NULL);
 	widget_schedule_redraw(clock->widget);
 }
 
@@ -467,6 +473,7 @@ panel_add_clock(struct panel *panel)
 
 	clock->widget = widget_add_widget(panel->widget, clock);
 	widget_set_redraw_handler(clock->widget, panel_clock_redraw_handler);
+	widget_set_damage_tracking(clock->widget, 1);
 }
 
 static void
@@ -605,6 +612,7 @@ panel_create(struct desktop *desktop, struct output *output)
 	window_set_user_data(panel->window, panel);
 
 	widget_set_redraw_handler(panel->widget, panel_redraw_handler);
+	widget_set_damage_tracking(panel->widget, 1);
 	widget_set_resize_handler(panel->widget, panel_resize_handler);
 
 	panel->panel_position = desktop->panel_position;
@@ -728,6 +736,7 @@ panel_add_launcher(struct panel *panel, const char *icon, const char *path)
 				    panel_launcher_touch_up_handler);
 	widget_set_redraw_handler(launcher->widget,
 				  panel_launcher_redraw_handler);
+	widget_set_damage_tracking(launcher->widget, 1);
 	widget_set_motion_handler(launcher->widget,
 				  panel_launcher_motion_handler);
 }
@@ -111,43 +111,25 @@ redraw_handler(struct widget *widget, void *data)
 	struct image *image = data;
 	struct rectangle allocation;
 	cairo_t *cr;
-	cairo_surface_t *surface;
-	double width, height, doc_aspect, window_aspect, scale;
 	cairo_matrix_t matrix;
 	cairo_matrix_t translate;
 
-	surface = window_get_surface(image->window);
-	cr = cairo_create(surface);
+	/* Called once per tile from the render threads, see
+	 * widget_set_tiled_redraw(): only read the image state here. */
+	cr = widget_cairo_create(widget);
 	widget_get_allocation(image->widget, &allocation);
 	cairo_rectangle(cr, allocation.x, allocation.y,
 			allocation.width, allocation.height);
 	cairo_clip(cr);
-	cairo_push_group(cr);
 	cairo_translate(cr, allocation.x, allocation.y);
 
+	/* No group needed: the opaque background replaces the old
+	 * contents, and the image is blended over it in place. */
+
 	cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
 	cairo_set_source_rgba(cr, 0, 0, 0, 1);
 	cairo_paint(cr);
 
-	if (!image->initialized) {
-		image->initialized = true;
-		width = cairo_image_surface_get_width(image->image);
-		height = cairo_image_surface_get_height(image->image);
-
-		doc_aspect = width / height;
-		window_aspect = (double) allocation.width / allocation.height;
-		if (doc_aspect < window_aspect)
-			scale = allocation.height / height;
-		else
-			scale = allocation.width / width;
-
-		image->width = width;
-		image->height = height;
-		cairo_matrix_init_scale(&image->matrix, scale, scale);
-
-		clamp_view(image);
-	}
-
 	matrix = image->matrix;
 	cairo_matrix_init_translate(&translate, allocation.x, allocation.y);
 	cairo_matrix_multiply(&matrix, &matrix, &translate);
@@ -157,11 +139,7 @@ redraw_handler(struct widget *widget, void *data)
 	cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
 	cairo_paint(cr);
 
-	cairo_pop_group_to_source(cr);
-	cairo_paint(cr);
 	cairo_destroy(cr);
-
-	cairo_surface_destroy(surface);
 }
 
 static void
@@ -169,6 +147,24 @@ resize_handler(struct widget *widget,
 	       int32_t width, int32_t height, void *data)
 {
 	struct image *image = data;
+	double image_width, image_height, doc_aspect, window_aspect, scale;
+
+	if (!image->initialized && width > 0 && height > 0) {
+		image->initialized = true;
+		image_width = cairo_image_surface_get_width(image->image);
+		image_height = cairo_image_surface_get_height(image->image);
+
+		doc_aspect = image_width / image_height;
+		window_aspect = (double) width / height;
+		if (doc_aspect < window_aspect)
+			scale = height / image_height;
+		else
+			scale = width / image_width;
+
+		image->width = image_width;
+		image->height = image_height;
+		cairo_matrix_init_scale(&image->matrix, scale, scale);
+	}
 
 	clamp_view(image);
 }
@@ -391,6 +387,7 @@ image_create(struct display *display, const char *filename,
 	window_set_user_data(image->window, image);
 	widget_set_redraw_handler(image->widget, redraw_handler);
 	widget_set_resize_handler(image->widget, resize_handler);
+	widget_set_tiled_redraw(image->widget, 1);
 	window_set_keyboard_focus_handler(image->window,
 					  keyboard_focus_handler);
 	window_set_fullscreen_handler(image->window, fullscreen_handler);
@@ -412,6 +409,7 @@ main(int argc, char *argv[])
 	struct display *d;
 	int i;
 	int image_counter = 0;
+	long cpus;
 
 	if (argc <= 1 || argv[1][0]=='-') {
 		printf("Usage: %s image...\n", argv[0]);
@@ -425,6 +423,11 @@ main(int argc, char *argv[])
 		return -1;
 	}
 
+	/* The main thread draws a tile too while it waits for the others */
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus > 1)
+		display_set_render_threads(d, cpus - 1);
+
 	for (i = 1; i < argc; i++)
 		image_create(d, argv[i], &image_counter);
 
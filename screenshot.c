@@ -24,6 +24,7 @@
 #include "config.h"
 
 #include <stdint.h>
+#include <inttypes.h>
 #include <errno.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -31,12 +32,18 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
 #include <sys/param.h>
 #include <sys/mman.h>
-#include <cairo.h>
+#include <sys/stat.h>
+#include <zlib.h>
 
 #include <wayland-client.h>
 #include "weston-screenshooter-client-protocol.h"
+#include <libweston/config-parser.h>
+#include "shared/helpers.h"
 #include "shared/os-compatibility.h"
 #include "shared/xalloc.h"
 #include "shared/file-util.h"
@@ -46,11 +53,15 @@
  * side marshalling outside libwayland.so */
 
 
+/* Buffers per output: a screenshot uses the first one, a recording
+ * captures into one while frames in the others are being written. */
+#define RECORD_SLOTS		3
+
 struct screenshooter_output {
 	struct wl_output *output;
-	struct wl_buffer *buffer;
+	struct wl_buffer *buffer[RECORD_SLOTS];
 	int width, height, offset_x, offset_y;
-	void *data;
+	void *data[RECORD_SLOTS];
 	struct wl_list link;
 };
 
@@ -61,6 +72,49 @@ struct buffer_size {
 	int max_x, max_y;
 };
 
+/* The PNG is compressed in strips of rows, each by one of the encoder
+ * threads into a deflate stream of its own. A stream that isn't the
+ * last ends with a sync flush, which leaves it byte aligned without
+ * ending the data, so the strips are simply written one after the
+ * other; their Adler-32 checksums are combined for the zlib trailer.
+ * Rows are taken from the output buffers as they are encoded. The
+ * threads are kept for all images of the same size, so that a
+ * recording doesn't start and join them for every frame. */
+#define PNG_STRIP_ROWS		64
+#define PNG_MAX_THREADS		16
+#define PNG_MAX_PENDING		(4 * PNG_MAX_THREADS)
+#define PNG_ZLIB_HEADER		2
+#define PNG_ZLIB_TRAILER	4
+
+struct png_strip {
+	/* zlib header room, raw deflate data, zlib trailer room */
+	unsigned char *data;
+	size_t length;
+	uLong adler;
+	z_off_t raw_length;
+	int done;
+};
+
+struct png_encoder {
+	const struct buffer_size *size;
+	struct wl_list *output_list;
+	int row_length;		/* filter type byte and RGB pixels */
+	pthread_t threads[PNG_MAX_THREADS];
+	int thread_count;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	struct png_strip *strips;
+	int strip_count;
+	int encoding;		/* an image is being encoded */
+	int slot;		/* the output buffers to encode */
+	int next_strip;		/* first strip no thread has taken */
+	int written;		/* strips written to the file */
+	int busy;		/* threads encoding a strip */
+	int failed;
+	int stop;
+};
+
 struct screenshooter_data {
 	struct wl_shm *shm;
 	struct wl_list output_list;
@@ -69,6 +123,32 @@ struct screenshooter_data {
 	int buffer_copy_done;
 };
 
+struct record_frame {
+	int full;
+	uint32_t number;
+	uint64_t usec;		/* since the start of the recording */
+};
+
+/* Frames go from the capture loop to the writer thread through the
+ * slots, in order; the loop drops frames while all slots are full. */
+struct recorder {
+	const char *dir;
+	struct png_encoder encoder;
+	FILE *index;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	struct record_frame frames[RECORD_SLOTS];
+	int head;		/* next slot to write */
+	int stop;
+	int failed;
+};
+
+static char *option_record;
+static int option_rate = 10;
+static int option_duration;
+static volatile sig_atomic_t record_interrupted;
+
 
 static void
 display_handle_geometry(void *data,
@@ -196,52 +276,362 @@ screenshot_create_shm_buffer(int width, int height, void **data_out,
 	return buffer;
 }
 
+/* Row y of the screenshot as RGB, black where no output covers it */
 static void
-screenshot_write_png(const struct buffer_size *buff_size,
-		     struct wl_list *output_list)
+png_get_row(struct png_encoder *encoder, int y, unsigned char *rgb)
 {
-	int output_stride, buffer_stride, i;
-	cairo_surface_t *surface;
-	void *data, *d, *s;
-	struct screenshooter_output *output, *next;
-	FILE *fp;
-	char filepath[PATH_MAX];
+	const struct buffer_size *size = encoder->size;
+	struct screenshooter_output *output;
+	const uint32_t *s;
+	unsigned char *d;
+	int oy, i;
+
+	memset(rgb, 0, size->width * 3);
+
+	wl_list_for_each(output, encoder->output_list, link) {
+		oy = y + size->min_y - output->offset_y;
+		if (oy < 0 || oy >= output->height)
+			continue;
+
+		s = (const uint32_t *) output->data[encoder->slot] +
+			oy * output->width;
+		d = rgb + (output->offset_x - size->min_x) * 3;
+		for (i = 0; i < output->width; i++) {
+			*d++ = s[i] >> 16;
+			*d++ = s[i] >> 8;
+			*d++ = s[i];
+		}
+	}
+}
 
-	buffer_stride = buff_size->width * 4;
+/* Filter the rows of a strip with the Up filter and compress them;
+ * prev and cur are scratch rows of RGB, line one filtered row. */
+static int
+png_encode_strip(struct png_encoder *encoder, int index,
+		 unsigned char *prev, unsigned char *cur, unsigned char *line)
+{
+	struct png_strip *strip = &encoder->strips[index];
+	int width = encoder->size->width * 3;
+	int y, first, end, i, ret;
+	unsigned char *tmp;
+	z_stream zs = {};
+	uLong bound;
+
+	first = index * PNG_STRIP_ROWS;
+	end = MIN(first + PNG_STRIP_ROWS, encoder->size->height);
+
+	if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8,
+			 Z_DEFAULT_STRATEGY) != Z_OK)
+		return -1;
+
+	strip->raw_length = (z_off_t) (end - first) * encoder->row_length;
+	/* a sync flush adds an empty stored block to the bound */
+	bound = deflateBound(&zs, strip->raw_length) + 16;
+	strip->data = malloc(PNG_ZLIB_HEADER + bound + PNG_ZLIB_TRAILER);
+	if (!strip->data) {
+		deflateEnd(&zs);
+		return -1;
+	}
+	zs.next_out = strip->data + PNG_ZLIB_HEADER;
+	zs.avail_out = bound;
+	strip->adler = adler32(0, NULL, 0);
+
+	if (first > 0)
+		png_get_row(encoder, first - 1, prev);
+	else
+		memset(prev, 0, width);
+
+	ret = Z_OK;
+	for (y = first; y < end && ret == Z_OK; y++) {
+		png_get_row(encoder, y, cur);
+		line[0] = 2; /* Up */
+		for (i = 0; i < width; i++)
+			line[i + 1] = cur[i] - prev[i];
+		strip->adler = adler32(strip->adler, line,
+				       encoder->row_length);
+
+		zs.next_in = line;
+		zs.avail_in = encoder->row_length;
+		if (y < end - 1)
+			ret = deflate(&zs, Z_NO_FLUSH);
+		else if (end < encoder->size->height)
+			ret = deflate(&zs, Z_SYNC_FLUSH);
+		else
+			ret = deflate(&zs, Z_FINISH);
+		if (zs.avail_in != 0)
+			ret = Z_BUF_ERROR;
+
+		tmp = prev;
+		prev = cur;
+		cur = tmp;
+	}
+
+	strip->length = bound - zs.avail_out;
+	deflateEnd(&zs);
+
+	/* Only the last strip finishes the stream; Z_OK from Z_FINISH
+	 * would mean it ran out of room and the data is cut short */
+	if (end == encoder->size->height)
+		return ret == Z_STREAM_END ? 0 : -1;
+	return ret == Z_OK ? 0 : -1;
+}
 
-	data = xmalloc(buffer_stride * buff_size->height);
-	if (!data)
-		return;
+static void *
+png_encode_thread(void *data)
+{
+	struct png_encoder *encoder = data;
+	unsigned char *prev, *cur, *line;
+	int index, ret;
+
+	prev = xmalloc(encoder->size->width * 3);
+	cur = xmalloc(encoder->size->width * 3);
+	line = xmalloc(encoder->row_length);
+
+	pthread_mutex_lock(&encoder->mutex);
+	for (;;) {
+		/* Wait for a strip of the current image, staying a
+		 * bounded number of strips ahead of the writer */
+		while (!encoder->stop &&
+		       (!encoder->encoding || encoder->failed ||
+			encoder->next_strip >= encoder->strip_count ||
+			encoder->next_strip >=
+			encoder->written + PNG_MAX_PENDING))
+			pthread_cond_wait(&encoder->cond, &encoder->mutex);
+		if (encoder->stop)
+			break;
+
+		index = encoder->next_strip++;
+		encoder->busy++;
+		pthread_mutex_unlock(&encoder->mutex);
+
+		ret = png_encode_strip(encoder, index, prev, cur, line);
+
+		pthread_mutex_lock(&encoder->mutex);
+		if (ret < 0)
+			encoder->failed = 1;
+		encoder->strips[index].done = 1;
+		encoder->busy--;
+		pthread_cond_broadcast(&encoder->cond);
+	}
+	pthread_mutex_unlock(&encoder->mutex);
+
+	free(prev);
+	free(cur);
+	free(line);
+
+	return NULL;
+}
 
-	wl_list_for_each_safe(output, next, output_list, link) {
-		output_stride = output->width * 4;
-		s = output->data;
-		d = data + (output->offset_y - buff_size->min_y) * buffer_stride +
-			   (output->offset_x - buff_size->min_x) * 4;
+static void
+png_put_u32(unsigned char *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
 
-		for (i = 0; i < output->height; i++) {
-			memcpy(d, s, output_stride);
-			d += buffer_stride;
-			s += output_stride;
+static void
+png_write_chunk(FILE *fp, const char *type,
+		const unsigned char *data, uint32_t length)
+{
+	unsigned char buf[4];
+	uLong crc;
+
+	png_put_u32(buf, length);
+	fwrite(buf, 1, 4, fp);
+	fwrite(type, 1, 4, fp);
+	fwrite(data, 1, length, fp);
+
+	crc = crc32(0, (const unsigned char *) type, 4);
+	if (length > 0)
+		crc = crc32(crc, data, length);
+	png_put_u32(buf, crc);
+	fwrite(buf, 1, 4, fp);
+}
+
+/* Write the strips to the file in order, as the threads finish them */
+static int
+png_write_strips(struct png_encoder *encoder, FILE *fp)
+{
+	struct png_strip *strip;
+	unsigned char *data;
+	uLong adler = adler32(0, NULL, 0);
+	uint32_t length;
+	int i;
+
+	for (i = 0; i < encoder->strip_count; i++) {
+		strip = &encoder->strips[i];
+
+		pthread_mutex_lock(&encoder->mutex);
+		while (!strip->done && !encoder->failed)
+			pthread_cond_wait(&encoder->cond, &encoder->mutex);
+		pthread_mutex_unlock(&encoder->mutex);
+		if (encoder->failed)
+			return -1;
+
+		data = strip->data + PNG_ZLIB_HEADER;
+		length = strip->length;
+		adler = adler32_combine(adler, strip->adler,
+					strip->raw_length);
+
+		if (i == 0) {
+			/* deflate, 32k window, default compression */
+			data -= PNG_ZLIB_HEADER;
+			data[0] = 0x78;
+			data[1] = 0x9c;
+			length += PNG_ZLIB_HEADER;
+		}
+		if (i == encoder->strip_count - 1) {
+			png_put_u32(data + length, adler);
+			length += PNG_ZLIB_TRAILER;
 		}
+		png_write_chunk(fp, "IDAT", data, length);
 
-		free(output);
+		free(strip->data);
+		strip->data = NULL;
+
+		pthread_mutex_lock(&encoder->mutex);
+		encoder->written++;
+		pthread_cond_broadcast(&encoder->cond);
+		pthread_mutex_unlock(&encoder->mutex);
+	}
+
+	return 0;
+}
+
+static void
+png_encoder_fini(struct png_encoder *encoder)
+{
+	int i;
+
+	pthread_mutex_lock(&encoder->mutex);
+	encoder->stop = 1;
+	pthread_cond_broadcast(&encoder->cond);
+	pthread_mutex_unlock(&encoder->mutex);
+	for (i = 0; i < encoder->thread_count; i++)
+		pthread_join(encoder->threads[i], NULL);
+
+	free(encoder->strips);
+	pthread_mutex_destroy(&encoder->mutex);
+	pthread_cond_destroy(&encoder->cond);
+}
+
+/* Start the encoder threads for images of the given size */
+static int
+png_encoder_init(struct png_encoder *encoder,
+		 const struct buffer_size *buff_size,
+		 struct wl_list *output_list)
+{
+	int thread_count;
+	long cpus;
+
+	memset(encoder, 0, sizeof *encoder);
+	encoder->size = buff_size;
+	encoder->output_list = output_list;
+	encoder->row_length = 1 + buff_size->width * 3;
+	encoder->strip_count = howmany(buff_size->height, PNG_STRIP_ROWS);
+	encoder->strips = xzalloc(encoder->strip_count *
+				  sizeof encoder->strips[0]);
+	pthread_mutex_init(&encoder->mutex, NULL);
+	pthread_cond_init(&encoder->cond, NULL);
+
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	thread_count = MIN(MAX(cpus, 1), PNG_MAX_THREADS);
+	thread_count = MIN(thread_count, encoder->strip_count);
+	for (; encoder->thread_count < thread_count; encoder->thread_count++) {
+		if (pthread_create(&encoder->threads[encoder->thread_count],
+				   NULL, png_encode_thread, encoder) != 0)
+			break;
+	}
+
+	if (encoder->thread_count == 0) {
+		png_encoder_fini(encoder);
+		return -1;
 	}
 
-	surface = cairo_image_surface_create_for_data(data,
-						      CAIRO_FORMAT_ARGB32,
-						      buff_size->width,
-						      buff_size->height,
-						      buffer_stride);
+	return 0;
+}
+
+/* Encode the output buffers of the slot as a PNG into fp */
+static int
+png_encoder_encode(struct png_encoder *encoder, int slot, FILE *fp)
+{
+	static const unsigned char signature[8] = {
+		0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'
+	};
+	const struct buffer_size *buff_size = encoder->size;
+	unsigned char ihdr[13];
+	int i, ret;
+
+	pthread_mutex_lock(&encoder->mutex);
+	memset(encoder->strips, 0,
+	       encoder->strip_count * sizeof encoder->strips[0]);
+	encoder->slot = slot;
+	encoder->next_strip = 0;
+	encoder->written = 0;
+	encoder->failed = 0;
+	encoder->encoding = 1;
+	pthread_cond_broadcast(&encoder->cond);
+	pthread_mutex_unlock(&encoder->mutex);
+
+	fwrite(signature, 1, sizeof signature, fp);
+	png_put_u32(&ihdr[0], buff_size->width);
+	png_put_u32(&ihdr[4], buff_size->height);
+	ihdr[8] = 8;	/* bit depth */
+	ihdr[9] = 2;	/* RGB */
+	ihdr[10] = 0;	/* deflate */
+	ihdr[11] = 0;	/* adaptive filtering */
+	ihdr[12] = 0;	/* no interlace */
+	png_write_chunk(fp, "IHDR", ihdr, sizeof ihdr);
+
+	ret = png_write_strips(encoder, fp);
+	if (ret == 0)
+		png_write_chunk(fp, "IEND", NULL, 0);
+
+	/* Let the threads finish the strips they took before the
+	 * strips are reused */
+	pthread_mutex_lock(&encoder->mutex);
+	encoder->encoding = 0;
+	encoder->failed |= ret < 0;
+	pthread_cond_broadcast(&encoder->cond);
+	while (encoder->busy > 0)
+		pthread_cond_wait(&encoder->cond, &encoder->mutex);
+	pthread_mutex_unlock(&encoder->mutex);
+
+	for (i = 0; i < encoder->strip_count; i++)
+		free(encoder->strips[i].data);
+
+	return ret;
+}
+
+static void
+screenshot_write_png(const struct buffer_size *buff_size,
+		     struct wl_list *output_list)
+{
+	struct screenshooter_output *output, *next;
+	struct png_encoder encoder;
+	FILE *fp;
+	char filepath[PATH_MAX];
 
 	fp = file_create_dated(getenv("XDG_PICTURES_DIR"), "wayland-screenshot-",
 			       ".png", filepath, sizeof(filepath));
 	if (fp) {
-		fclose (fp);
-		cairo_surface_write_to_png(surface, filepath);
+		if (png_encoder_init(&encoder, buff_size, output_list) < 0) {
+			fprintf(stderr, "failed to start the encoder threads\n");
+		} else {
+			if (png_encoder_encode(&encoder, 0, fp) < 0)
+				fprintf(stderr, "failed to encode %s\n",
+					filepath);
+			png_encoder_fini(&encoder);
+		}
+		if (fclose(fp) != 0)
+			fprintf(stderr, "failed to write %s: %s\n",
+				filepath, strerror(errno));
 	}
-	cairo_surface_destroy(surface);
-	free(data);
+
+	wl_list_for_each_safe(output, next, output_list, link)
+		free(output);
 }
 
 static int
@@ -276,14 +666,267 @@ screenshot_set_buffer_size(struct buffer_size *buff_size, struct wl_list *output
 	return 0;
 }
 
+static int
+screenshot_create_buffers(struct screenshooter_data *sh_data, int slots)
+{
+	struct screenshooter_output *output;
+	int i;
+
+	wl_list_for_each(output, &sh_data->output_list, link) {
+		for (i = 0; i < slots; i++) {
+			output->buffer[i] =
+				screenshot_create_shm_buffer(output->width,
+							     output->height,
+							     &output->data[i],
+							     sh_data->shm);
+			if (!output->buffer[i])
+				return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Copy all outputs into their buffers of the slot */
+static void
+screenshot_shoot(struct wl_display *display,
+		 struct screenshooter_data *sh_data, int slot)
+{
+	struct screenshooter_output *output;
+
+	wl_list_for_each(output, &sh_data->output_list, link) {
+		weston_screenshooter_shoot(sh_data->screenshooter,
+					   output->output,
+					   output->buffer[slot]);
+		sh_data->buffer_copy_done = 0;
+		while (!sh_data->buffer_copy_done)
+			wl_display_roundtrip(display);
+	}
+}
+
+static int
+record_write_frame(struct recorder *recorder, int slot)
+{
+	struct record_frame *frame = &recorder->frames[slot];
+	char filename[64], filepath[PATH_MAX];
+	FILE *fp;
+	int ret;
+
+	snprintf(filename, sizeof filename, "frame-%06u.png", frame->number);
+	snprintf(filepath, sizeof filepath, "%s/%s", recorder->dir, filename);
+
+	fp = fopen(filepath, "wb");
+	if (!fp) {
+		fprintf(stderr, "failed to create %s: %s\n",
+			filepath, strerror(errno));
+		return -1;
+	}
+
+	ret = png_encoder_encode(&recorder->encoder, slot, fp);
+	if (fclose(fp) != 0)
+		ret = -1;
+	if (ret < 0) {
+		fprintf(stderr, "failed to write %s\n", filepath);
+		return -1;
+	}
+
+	fprintf(recorder->index, "%u %" PRIu64 " %s\n",
+		frame->number, frame->usec, filename);
+	fflush(recorder->index);
+
+	return 0;
+}
+
+static void *
+record_writer_thread(void *data)
+{
+	struct recorder *recorder = data;
+	int slot, failed, ret;
+
+	pthread_mutex_lock(&recorder->mutex);
+	for (;;) {
+		slot = recorder->head;
+		while (!recorder->frames[slot].full && !recorder->stop)
+			pthread_cond_wait(&recorder->cond, &recorder->mutex);
+		if (!recorder->frames[slot].full)
+			break;
+		failed = recorder->failed;
+		pthread_mutex_unlock(&recorder->mutex);
+
+		ret = failed ? -1 : record_write_frame(recorder, slot);
+
+		pthread_mutex_lock(&recorder->mutex);
+		if (ret < 0)
+			recorder->failed = 1;
+		recorder->frames[slot].full = 0;
+		recorder->head = (slot + 1) % RECORD_SLOTS;
+		pthread_cond_broadcast(&recorder->cond);
+	}
+	pthread_mutex_unlock(&recorder->mutex);
+
+	return NULL;
+}
+
+static void
+record_signal_handler(int signum)
+{
+	record_interrupted = 1;
+}
+
+static uint64_t
+timespec_to_usec(const struct timespec *ts)
+{
+	return (uint64_t) ts->tv_sec * 1000000 + ts->tv_nsec / 1000;
+}
+
+/* Capture all outputs option_rate times a second into a numbered PNG
+ * per frame, until option_duration seconds have passed or on SIGINT.
+ * index.txt in the directory lists the frame number, the capture time
+ * in microseconds and the file of each frame. The buffers are created
+ * once and reused; frames that come up while the writer is behind by
+ * all slots are dropped. */
+static int
+screenshot_record(struct wl_display *display,
+		  struct screenshooter_data *sh_data,
+		  const struct buffer_size *buff_size)
+{
+	struct recorder recorder = {};
+	struct sigaction sigint = {};
+	struct timespec start, next, now;
+	char filepath[PATH_MAX];
+	pthread_t writer;
+	uint64_t interval, elapsed;
+	uint32_t number = 0, dropped = 0;
+	int slot = 0;
+
+	if (option_rate <= 0) {
+		fprintf(stderr, "invalid frame rate %d\n", option_rate);
+		return -1;
+	}
+	interval = 1000000 / option_rate;
+
+	if (mkdir(option_record, 0755) < 0 && errno != EEXIST) {
+		fprintf(stderr, "failed to create %s: %s\n",
+			option_record, strerror(errno));
+		return -1;
+	}
+	snprintf(filepath, sizeof filepath, "%s/index.txt", option_record);
+	recorder.index = fopen(filepath, "w");
+	if (!recorder.index) {
+		fprintf(stderr, "failed to create %s: %s\n",
+			filepath, strerror(errno));
+		return -1;
+	}
+
+	if (screenshot_create_buffers(sh_data, RECORD_SLOTS) < 0) {
+		fclose(recorder.index);
+		return -1;
+	}
+
+	recorder.dir = option_record;
+	if (png_encoder_init(&recorder.encoder, buff_size,
+			     &sh_data->output_list) < 0) {
+		fprintf(stderr, "failed to start the encoder threads\n");
+		fclose(recorder.index);
+		return -1;
+	}
+	pthread_mutex_init(&recorder.mutex, NULL);
+	pthread_cond_init(&recorder.cond, NULL);
+	if (pthread_create(&writer, NULL, record_writer_thread,
+			   &recorder) != 0) {
+		fprintf(stderr, "failed to start the writer thread\n");
+		png_encoder_fini(&recorder.encoder);
+		fclose(recorder.index);
+		return -1;
+	}
+
+	sigint.sa_handler = record_signal_handler;
+	sigint.sa_flags = SA_RESTART;
+	sigaction(SIGINT, &sigint, NULL);
+	sigaction(SIGTERM, &sigint, NULL);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	next = start;
+	while (!record_interrupted) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		elapsed = timespec_to_usec(&now) - timespec_to_usec(&start);
+		if (option_duration > 0 &&
+		    elapsed >= (uint64_t) option_duration * 1000000)
+			break;
+
+		pthread_mutex_lock(&recorder.mutex);
+		if (recorder.failed) {
+			pthread_mutex_unlock(&recorder.mutex);
+			break;
+		}
+		if (recorder.frames[slot].full) {
+			dropped++;
+		} else {
+			pthread_mutex_unlock(&recorder.mutex);
+			screenshot_shoot(display, sh_data, slot);
+			pthread_mutex_lock(&recorder.mutex);
+
+			recorder.frames[slot].number = number;
+			recorder.frames[slot].usec = elapsed;
+			recorder.frames[slot].full = 1;
+			slot = (slot + 1) % RECORD_SLOTS;
+			pthread_cond_broadcast(&recorder.cond);
+		}
+		number++;
+		pthread_mutex_unlock(&recorder.mutex);
+
+		/* Wait for the next frame time, skipping the ones the
+		 * capture overran */
+		do {
+			next.tv_nsec += interval * 1000;
+			next.tv_sec += next.tv_nsec / 1000000000;
+			next.tv_nsec %= 1000000000;
+		} while (timespec_to_usec(&next) <= timespec_to_usec(&now));
+		while (!record_interrupted &&
+		       clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+				       &next, NULL) == EINTR)
+			;
+	}
+
+	pthread_mutex_lock(&recorder.mutex);
+	recorder.stop = 1;
+	pthread_cond_broadcast(&recorder.cond);
+	pthread_mutex_unlock(&recorder.mutex);
+	pthread_join(writer, NULL);
+	png_encoder_fini(&recorder.encoder);
+
+	pthread_mutex_destroy(&recorder.mutex);
+	pthread_cond_destroy(&recorder.cond);
+	fclose(recorder.index);
+
+	printf("recorded %u frames to %s, %u dropped\n",
+	       number - dropped, option_record, dropped);
+
+	return recorder.failed ? -1 : 0;
+}
+
+static const struct weston_option screenshot_options[] = {
+	{ WESTON_OPTION_STRING, "record", 0, &option_record },
+	{ WESTON_OPTION_INTEGER, "rate", 0, &option_rate },
+	{ WESTON_OPTION_INTEGER, "duration", 0, &option_duration },
+};
+
 int main(int argc, char *argv[])
 {
 	struct wl_display *display;
 	struct wl_registry *registry;
-	struct screenshooter_output *output;
 	struct buffer_size buff_size = {};
 	struct screenshooter_data sh_data = {};
 
+	if (parse_options(screenshot_options,
+			  ARRAY_LENGTH(screenshot_options), &argc, argv) > 1) {
+		printf("Usage: %s [OPTIONS]\n"
+		       "  --record=DIR\n"
+		       "  --rate=FRAMES_PER_SECOND\n"
+		       "  --duration=SECONDS\n", argv[0]);
+		return 1;
+	}
+
 	display = wl_display_connect(NULL);
 	if (display == NULL) {
 		fprintf(stderr, "failed to create display: %s\n",
@@ -308,20 +951,12 @@ int main(int argc, char *argv[])
 	if (screenshot_set_buffer_size(&buff_size, &sh_data.output_list))
 		return -1;
 
+	if (option_record)
+		return screenshot_record(display, &sh_data, &buff_size);
 
-	wl_list_for_each(output, &sh_data.output_list, link) {
-		output->buffer =
-			screenshot_create_shm_buffer(output->width,
-						     output->height,
-						     &output->data,
-						     sh_data.shm);
-		weston_screenshooter_shoot(sh_data.screenshooter,
-					   output->output,
-					   output->buffer);
-		sh_data.buffer_copy_done = 0;
-		while (!sh_data.buffer_copy_done)
-			wl_display_roundtrip(display);
-	}
+	if (screenshot_create_buffers(&sh_data, 1) < 0)
+		return -1;
+	screenshot_shoot(display, &sh_data, 0);
 
 	screenshot_write_png(&buff_size, &sh_data.output_list);
 
@@ -57,12 +57,16 @@
 static int32_t option_red_mode;
 static int32_t option_triangle_mode;
 static int32_t option_no_triangle;
+static int32_t option_render_thread;
+static int32_t option_buffers;
 static int32_t option_help;
 
 static const struct weston_option options[] = {
 	{ WESTON_OPTION_INTEGER, "red-mode", 'r', &option_red_mode },
 	{ WESTON_OPTION_INTEGER, "triangle-mode", 't', &option_triangle_mode },
 	{ WESTON_OPTION_BOOLEAN, "no-triangle", 'n', &option_no_triangle },
+	{ WESTON_OPTION_BOOLEAN, "render-thread", 'j', &option_render_thread },
+	{ WESTON_OPTION_INTEGER, "buffers", 'b', &option_buffers },
 	{ WESTON_OPTION_BOOLEAN, "help", 'h', &option_help },
 };
 
@@ -86,6 +90,8 @@ static const char help_text[] =
 "  -r, --red-mode=MODE\t\tthe commit mode for the red sub-surface (0)\n"
 "  -t, --triangle-mode=MODE\tthe commit mode for the GL sub-surface (0)\n"
 "  -n, --no-triangle\t\tDo not create the GL sub-surface.\n"
+"  -j, --render-thread\t\tDraw the red sub-surface on a render thread.\n"
+"  -b, --buffers=COUNT\t\tshm buffers the red sub-surface may use (3)\n"
 "\n"
 "The MODE is the wl_subsurface commit mode used by default for the\n"
 "given sub-surface. Valid values are the integers:\n"
@@ -110,6 +116,10 @@ static const char help_text[] =
 "You can trigger a main surface repaint, without a resize, by\n"
 "hovering the pointer over the title bar buttons.\n"
 "\n"
+"With fewer buffers, the red sub-surface runs out of free ones\n"
+"sooner while the compositor holds them and skips frames; the\n"
+"number of such waits is printed on exit.\n"
+"\n"
 "Resizing will temporarily toggle the commit mode of all sub-surfaces\n"
 "to guarantee synchronized rendering on size changes. It also forces\n"
 "a repaint of all surfaces.\n"
@@ -745,6 +755,9 @@ demoapp_create(struct display *display)
 		int_to_mode(option_red_mode));
 	widget_set_redraw_handler(app->subsurface, sub_redraw_handler);
 	widget_set_resize_handler(app->subsurface, sub_resize_handler);
+	widget_set_thread_safe(app->subsurface, 1);
+	if (option_buffers)
+		widget_set_max_buffers(app->subsurface, option_buffers);
 
 	if (app->egl && !option_no_triangle)
 		app->triangle = triangle_create(app->window, app->egl);
@@ -800,10 +813,19 @@ main(int argc, char *argv[])
 		return -1;
 	}
 
+	if (option_render_thread && display_set_render_threads(display, 1) == 0)
+		fprintf(stderr, "failed to start render thread, "
+			"drawing on the main thread\n");
+
 	app = demoapp_create(display);
 
 	display_run(display);
 
+	if (display_get_buffer_starvation_count(display))
+		printf("%u redraws waited for the compositor to release "
+		       "a buffer\n",
+		       display_get_buffer_starvation_count(display));
+
 	demoapp_destroy(app);
 	display_destroy(display);
 
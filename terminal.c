@@ -39,6 +39,9 @@
 #include <wchar.h>
 #include <locale.h>
 #include <errno.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include <linux/input.h>
 
@@ -46,6 +49,7 @@
 
 #include <libweston/config-parser.h>
 #include "shared/helpers.h"
+#include "shared/timespec-util.h"
 #include "shared/xalloc.h"
 #include "window.h"
 
@@ -55,6 +59,7 @@ static char *option_font;
 static int option_font_size;
 static char *option_term;
 static char *option_shell;
+static char *option_benchmark;
 
 static struct wl_list terminal_list;
 
@@ -64,6 +69,10 @@ static void
 terminal_destroy(struct terminal *terminal);
 static int
 terminal_run(struct terminal *terminal, const char *path);
+static void
+parse_timer_func(struct toytimer *tt);
+static void
+sync_timer_func(struct toytimer *tt);
 
 #define TERMINAL_DRAW_SINGLE_WIDE_CHARACTERS    \
     " !\"#$%&'()*+,-./"                         \
@@ -88,6 +97,21 @@ terminal_run(struct terminal *terminal, const char *path);
 /* Buffer sizes */
 #define MAX_RESPONSE		256
 #define MAX_ESCAPE		255
+#define MAX_SEARCH		128
+/* UTF-8 bytes a cell adds to the text a search looks at, at most */
+#define SEARCH_CELL_BYTES	4
+
+/* Output of the child is read into a ring buffer as fast as it
+ * arrives and parsed in slices, so that floods of output neither take
+ * a read per few hundred bytes nor hold up input and redraws. */
+#define PTY_BUFFER_SIZE		(128 * 1024)	/* power of two */
+#define PTY_PARSE_CHUNK		4096
+#define BENCHMARK_FRAME_BYTES	(64 * 1024)
+
+/* Redraws start this long before the compositor's next refresh: a few
+ * ms for drawing plus weston's default 7 ms repaint window */
+#define REDRAW_MARGIN_USEC	10000
+#define PTY_PARSE_BUDGET_NSEC	(4 * 1000 * 1000)
 
 /* Terminal modes */
 #define MODE_SHOW_CURSOR	0x00000001
@@ -98,6 +122,11 @@ terminal_run(struct terminal *terminal, const char *path);
 #define MODE_IRM		0x00000020
 #define MODE_DELETE_SENDS_DEL	0x00000040
 #define MODE_ALT_SENDS_ESC	0x00000080
+#define MODE_SYNCHRONIZED	0x00000100
+
+/* Longest time output is kept from the screen by a synchronized
+ * update, for applications that never end theirs */
+#define SYNC_TIMEOUT_USEC	150000
 
 union utf8_char {
 	unsigned char byte[4];
@@ -423,6 +452,73 @@ enum escape_state {
 #define ESC_FLAG_DQUOTE	0x20
 #define ESC_FLAG_SPACE	0x40
 
+/* Glyphs of a cell, as laid out at the origin. Direct mapped, the
+ * font of an unused entry is NULL. */
+#define GLYPH_CACHE_SIZE 1024
+
+struct glyph_cache_entry {
+	cairo_scaled_font_t *font;
+	union utf8_char c;
+	int num_glyphs;
+	cairo_glyph_t glyphs[4];
+};
+
+/* Scrollback lines that dropped out of the ring buffer, stored as
+ * compact records: a header, the UTF-8 text of the cells (a zero byte
+ * for an empty cell, HISTORY_SPACE_GLYPH for the cell after a wide
+ * character) up to the last cell holding a character or other than
+ * the default attributes, then runs of equal attributes. Records are
+ * packed into blocks of HISTORY_BLOCK_LINES lines. */
+#define HISTORY_BLOCK_LINES	256
+#define HISTORY_MAX_LINES	(128 * 1024)
+
+/* Stands for the 0x200B space glyph cell, never valid in UTF-8 */
+#define HISTORY_SPACE_GLYPH	0xff
+
+/* Each block also has a bitmap of the hashed byte trigrams of its
+ * text, so that searches skip blocks that can't contain the query. */
+#define HISTORY_TRIGRAM_BITS	16384
+
+struct history_record {
+	uint16_t cells;
+	uint16_t text_length;
+	uint16_t runs;
+};
+
+struct history_run {
+	uint16_t count;
+	struct attr attr;
+};
+
+struct history_block {
+	char *data;
+	size_t size, used;
+	uint32_t offsets[HISTORY_BLOCK_LINES];
+	int count;
+	uint32_t trigrams[HISTORY_TRIGRAM_BITS / 32];
+};
+
+struct terminal_history {
+	struct history_block **blocks;
+	int block_count, blocks_size;
+	uint32_t count;
+	/* Absolute number (as terminal->start) of the line after the
+	 * newest one stored */
+	uint32_t end;
+
+	/* Screen rows currently showing history, decoded, and the
+	 * absolute line number each of them holds, UINT64_MAX if none */
+	union utf8_char *view_data;
+	struct attr *view_attr;
+	uint64_t *view_lines;
+	int view_width, view_height;
+};
+
+/* Columns of a screen row changed since the last redraw */
+struct dirty_span {
+	int start, end;
+};
+
 enum {
 	SELECT_NONE,
 	SELECT_CHAR,
@@ -471,6 +567,7 @@ struct terminal {
 	cairo_font_extents_t extents;
 	double average_width;
 	cairo_scaled_font_t *font_normal, *font_bold;
+	struct glyph_cache_entry *glyph_cache;
 	uint32_t hide_cursor_serial;
 	int size_in_title;
 
@@ -483,6 +580,37 @@ struct terminal {
 	int selection_end_row, selection_end_col;
 	struct wl_list link;
 	int pace_pipe;
+
+	/* One span per screen row, empty when start >= end */
+	struct dirty_span *dirty;
+	int cursor_drawn_row, cursor_drawn_column;
+	/* Rows the drawn screen moved up since the last redraw */
+	int scrolled;
+
+	/* Decoded attributes of the screen rows, without the cursor;
+	 * a row is decoded again after it was marked dirty */
+	union decoded_attr *decoded;
+	char *decoded_valid;
+
+	struct terminal_history history;
+
+	/* Scrollback search, see handle_search_key() */
+	int searching, search_failed;
+	char search_query[MAX_SEARCH + 1];
+	int search_length;
+	uint32_t search_line;
+	union utf8_char *search_data;
+	struct attr *search_attr;
+	char *search_text;
+	int *search_columns;
+	int search_width;
+
+	/* Child output; pty_head and pty_tail count the bytes parsed
+	 * and read so far. */
+	char *pty_buffer;
+	uint32_t pty_head, pty_tail;
+	struct toytimer parse_timer;
+	struct toytimer sync_timer;
 };
 
 /* Create default tab stops, every 8 characters */
@@ -530,6 +658,14 @@ terminal_init(struct terminal *terminal)
 	if (terminal->tab_ruler != NULL) terminal_init_tabs(terminal);
 }
 
+/* Terminals without a window are run by the benchmark, and are
+ * drawn as if they had the keyboard focus. */
+static int
+terminal_has_focus(struct terminal *terminal)
+{
+	return !terminal->window || window_has_focus(terminal->window);
+}
+
 static void
 init_color_table(struct terminal *terminal)
 {
@@ -555,11 +691,284 @@ init_color_table(struct terminal *terminal)
 	}
 }
 
+static void
+history_clear(struct terminal_history *history)
+{
+	int i;
+
+	for (i = 0; i < history->block_count; i++) {
+		free(history->blocks[i]->data);
+		free(history->blocks[i]);
+	}
+	history->block_count = 0;
+	history->count = 0;
+
+	/* forget the decoded rows as well */
+	history->view_height = 0;
+}
+
+static void
+history_release(struct terminal_history *history)
+{
+	history_clear(history);
+	free(history->blocks);
+	free(history->view_data);
+	free(history->view_attr);
+	free(history->view_lines);
+}
+
+static int
+utf8_length(unsigned char c)
+{
+	if ((c & 0x80) == 0x00)       return 1;
+	else if ((c & 0xE0) == 0xC0)  return 2;
+	else if ((c & 0xF0) == 0xE0)  return 3;
+	else if ((c & 0xF8) == 0xF0)  return 4;
+	else                          return 1;
+}
+
+static uint32_t
+trigram_hash(const unsigned char *p)
+{
+	uint32_t t;
+
+	t = (p[0] ? p[0] : ' ') << 16 |
+	    (p[1] ? p[1] : ' ') << 8 |
+	    (p[2] ? p[2] : ' ');
+
+	return (t * 0x9e3779b1) >> (32 - 14);
+}
+
+static void *
+history_block_reserve(struct history_block *block, size_t length)
+{
+	if (block->used + length > block->size) {
+		block->size = MAX(block->size * 2, block->used + length);
+		block->data = xrealloc(block->data, block->size);
+	}
+
+	return block->data + block->used;
+}
+
+/* Append the line with absolute number line, as long as it continues
+ * the stored lines; anything else starts over. */
+static void
+history_push(struct terminal_history *history, uint32_t line,
+	     const union utf8_char *data, const struct attr *attr,
+	     int width, struct attr blank)
+{
+	struct history_block *block;
+	struct history_record record;
+	struct history_run run;
+	unsigned char trigram[3], *text, c;
+	char *p;
+	int cells, col, len, i, n;
+
+	if (history->count > 0 && line != history->end) {
+		if ((int32_t) (line - history->end) < 0)
+			return;
+		history_clear(history);
+	}
+
+	/* drop the oldest block once there are too many lines */
+	if (history->count >= HISTORY_MAX_LINES) {
+		block = history->blocks[0];
+		history->count -= block->count;
+		free(block->data);
+		free(block);
+		history->block_count--;
+		memmove(&history->blocks[0], &history->blocks[1],
+			history->block_count * sizeof history->blocks[0]);
+	}
+
+	if (history->block_count == 0 ||
+	    history->blocks[history->block_count - 1]->count ==
+	    HISTORY_BLOCK_LINES) {
+		if (history->block_count == history->blocks_size) {
+			history->blocks_size = MAX(16, history->blocks_size * 2);
+			history->blocks =
+				xrealloc(history->blocks, history->blocks_size *
+					 sizeof history->blocks[0]);
+		}
+		history->blocks[history->block_count++] =
+			xzalloc(sizeof *block);
+	}
+	block = history->blocks[history->block_count - 1];
+
+	/* trim blank cells at the end of the line */
+	for (cells = width; cells > 0; cells--) {
+		if (data[cells - 1].ch != 0 ||
+		    memcmp(&attr[cells - 1], &blank, sizeof blank) != 0)
+			break;
+	}
+
+	record.cells = cells;
+	record.text_length = 0;
+	record.runs = 0;
+	for (col = 0; col < cells; col++) {
+		record.text_length += data[col].ch && data[col].ch != 0x200B ?
+			utf8_length(data[col].byte[0]) : 1;
+		if (col == 0 || memcmp(&attr[col], &attr[col - 1],
+				       sizeof *attr) != 0)
+			record.runs++;
+	}
+
+	block->offsets[block->count++] = block->used;
+	p = history_block_reserve(block, sizeof record +
+				  record.text_length +
+				  record.runs * sizeof run);
+	memcpy(p, &record, sizeof record);
+	p += sizeof record;
+
+	for (col = 0; col < cells; col++) {
+		if (data[col].ch == 0x200B) {
+			*p++ = HISTORY_SPACE_GLYPH;
+			continue;
+		}
+		len = data[col].ch ? utf8_length(data[col].byte[0]) : 1;
+		for (i = 0; i < len; i++)
+			*p++ = data[col].byte[i];
+	}
+
+	/* Hash the text as terminal_search_line() sees it: without the
+	 * space glyph cells and followed by the blanks trimmed off */
+	text = (unsigned char *) p - record.text_length;
+	for (i = 0, n = 0; i < record.text_length + 3; i++) {
+		c = i < record.text_length ? text[i] : ' ';
+		if (c == HISTORY_SPACE_GLYPH)
+			continue;
+		trigram[0] = trigram[1];
+		trigram[1] = trigram[2];
+		trigram[2] = c;
+		if (++n < 3)
+			continue;
+		col = trigram_hash(trigram);
+		block->trigrams[col / 32] |= 1u << (col % 32);
+	}
+
+	for (col = 0; col < cells; col += run.count) {
+		run.attr = attr[col];
+		for (run.count = 1; col + run.count < cells; run.count++)
+			if (memcmp(&attr[col + run.count], &run.attr,
+				   sizeof run.attr) != 0)
+				break;
+		memcpy(p, &run, sizeof run);
+		p += sizeof run;
+	}
+
+	block->used = p - block->data;
+	history->count++;
+	history->end = line + 1;
+
+	/* full blocks don't grow anymore */
+	if (block->count == HISTORY_BLOCK_LINES) {
+		block->data = xrealloc(block->data, block->used);
+		block->size = block->used;
+	}
+}
+
+static int
+history_has_line(struct terminal_history *history, uint32_t line)
+{
+	return history->count > 0 &&
+		(int32_t) (line - history->end) < 0 &&
+		(int32_t) (line - (history->end - history->count)) >= 0;
+}
+
+static void
+history_decode(struct terminal_history *history, uint32_t line,
+	       union utf8_char *data, struct attr *attr,
+	       int width, struct attr blank)
+{
+	struct history_block *block;
+	struct history_record record;
+	struct history_run run;
+	const char *p;
+	uint32_t index;
+	int col, len, i, n;
+
+	/* only the newest block is ever partially filled */
+	index = line - (history->end - history->count);
+	block = history->blocks[index / HISTORY_BLOCK_LINES];
+	p = block->data + block->offsets[index % HISTORY_BLOCK_LINES];
+
+	memcpy(&record, p, sizeof record);
+	p += sizeof record;
+
+	memset(data, 0, width * sizeof *data);
+	for (col = 0; col < record.cells; col++) {
+		if ((unsigned char) *p == HISTORY_SPACE_GLYPH) {
+			if (col < width)
+				data[col].ch = 0x200B;
+			p++;
+			continue;
+		}
+		len = *p ? utf8_length(*p) : 1;
+		for (i = 0; i < len; i++, p++)
+			if (col < width)
+				data[col].byte[i] = *p;
+	}
+
+	attr_init(attr, blank, width);
+	for (col = 0, i = 0; i < record.runs; i++, col += run.count) {
+		memcpy(&run, p, sizeof run);
+		p += sizeof run;
+		n = MIN(run.count, width - col);
+		if (n > 0)
+			attr_init(&attr[col], run.attr, n);
+	}
+}
+
+/* The decoded history line shown in the given screen row */
+static int
+terminal_history_row(struct terminal *terminal, int row)
+{
+	struct terminal_history *history = &terminal->history;
+	uint32_t line = terminal->start + row;
+	int i;
+
+	if (history->view_width != terminal->max_width ||
+	    history->view_height < terminal->height) {
+		history->view_width = terminal->max_width;
+		history->view_height = terminal->height;
+		history->view_data =
+			xrealloc(history->view_data, terminal->height *
+				 terminal->data_pitch);
+		history->view_attr =
+			xrealloc(history->view_attr, terminal->height *
+				 terminal->attr_pitch);
+		history->view_lines =
+			xrealloc(history->view_lines, terminal->height *
+				 sizeof history->view_lines[0]);
+		for (i = 0; i < terminal->height; i++)
+			history->view_lines[i] = UINT64_MAX;
+	}
+
+	if (history->view_lines[row] != line) {
+		history_decode(history, line,
+			       (void *) history->view_data +
+			       row * terminal->data_pitch,
+			       (void *) history->view_attr +
+			       row * terminal->attr_pitch,
+			       terminal->max_width,
+			       terminal->color_scheme->default_attr);
+		history->view_lines[row] = line;
+	}
+
+	return row;
+}
+
 static union utf8_char *
 terminal_get_row(struct terminal *terminal, int row)
 {
 	int index;
 
+	if (history_has_line(&terminal->history, terminal->start + row)) {
+		index = terminal_history_row(terminal, row);
+		return (void *) terminal->history.view_data +
+			index * terminal->data_pitch;
+	}
+
 	index = (row + terminal->start) & (terminal->buffer_height - 1);
 
 	return (void *) terminal->data + index * terminal->data_pitch;
@@ -570,39 +979,155 @@ terminal_get_attr_row(struct terminal *terminal, int row)
 {
 	int index;
 
+	if (history_has_line(&terminal->history, terminal->start + row)) {
+		index = terminal_history_row(terminal, row);
+		return (void *) terminal->history.view_attr +
+			index * terminal->attr_pitch;
+	}
+
 	index = (row + terminal->start) & (terminal->buffer_height - 1);
 
 	return (void *) terminal->data_attr + index * terminal->attr_pitch;
 }
 
+/* The oldest line the view can be scrolled back to */
+static uint32_t
+terminal_log_start(struct terminal *terminal)
+{
+	uint32_t ring_start = terminal->end - terminal->log_size;
+	uint32_t history_start;
+
+	if (terminal->history.count == 0)
+		return ring_start;
+
+	history_start = terminal->history.end - terminal->history.count;
+	if ((int32_t) (history_start - ring_start) < 0)
+		return history_start;
+
+	return ring_start;
+}
+
+/* Move the line in the ring slot about to be reused for the given
+ * screen row to the history, if it still belongs to the log */
+static void
+terminal_evict_row(struct terminal *terminal, int row)
+{
+	uint32_t line = terminal->start + row - terminal->buffer_height;
+	int index;
+
+	if (terminal->log_size < terminal->buffer_height ||
+	    (int32_t) (line - (terminal->end - terminal->log_size)) < 0 ||
+	    (int32_t) (line - terminal->end) >= 0)
+		return;
+
+	index = line & (terminal->buffer_height - 1);
+	history_push(&terminal->history, line,
+		     (void *) terminal->data + index * terminal->data_pitch,
+		     (void *) terminal->data_attr +
+		     index * terminal->attr_pitch,
+		     terminal->width, terminal->color_scheme->default_attr);
+}
+
+/* Mark columns [start, end) of a screen row for the next redraw */
+static void
+terminal_dirty_cells(struct terminal *terminal, int row, int start, int end)
+{
+	struct dirty_span *span;
+
+	if (row < 0 || row >= terminal->height || start >= end)
+		return;
+
+	terminal->decoded_valid[row] = 0;
+	span = &terminal->dirty[row];
+	if (span->start >= span->end) {
+		span->start = start;
+		span->end = end;
+	} else {
+		if (start < span->start)
+			span->start = start;
+		if (end > span->end)
+			span->end = end;
+	}
+}
+
+/* Mark screen rows [first, end) for the next redraw */
+static void
+terminal_dirty_rows(struct terminal *terminal, int first, int end)
+{
+	int row;
+
+	if (first < 0)
+		first = 0;
+	if (end > terminal->height)
+		end = terminal->height;
+
+	for (row = first; row < end; row++) {
+		terminal->dirty[row].start = 0;
+		terminal->dirty[row].end = terminal->width;
+		terminal->decoded_valid[row] = 0;
+	}
+}
+
+static void
+terminal_dirty_all(struct terminal *terminal)
+{
+	terminal_dirty_rows(terminal, 0, terminal->height);
+	terminal->scrolled = 0;
+}
+
+/* The whole screen moved up by d rows (down when negative). The next
+ * redraw moves the drawn rows along in the buffer, so only the rows
+ * scrolled in have to be drawn. */
+static void
+terminal_dirty_scroll(struct terminal *terminal, int d)
+{
+	int n = terminal->height - abs(d);
+
+	/* Rows that moved are not drawn again, see
+	 * prepare_redraw_handler() */
+	memset(terminal->decoded_valid, 0, terminal->height);
+
+	if (n <= 0 || abs(terminal->scrolled + d) >= terminal->height) {
+		terminal_dirty_all(terminal);
+		return;
+	}
+
+	if (d > 0) {
+		memmove(&terminal->dirty[0], &terminal->dirty[d],
+			n * sizeof terminal->dirty[0]);
+		terminal_dirty_rows(terminal, n, terminal->height);
+	} else if (d < 0) {
+		memmove(&terminal->dirty[-d], &terminal->dirty[0],
+			n * sizeof terminal->dirty[0]);
+		terminal_dirty_rows(terminal, 0, -d);
+	}
+
+	terminal->cursor_drawn_row -= d;
+	terminal->scrolled += d;
+}
+
+static void
+terminal_dirty_selection(struct terminal *terminal)
+{
+	terminal_dirty_rows(terminal, terminal->selection_start_row,
+			    terminal->selection_end_row + 1);
+}
+
 union decoded_attr {
 	struct attr attr;
 	uint32_t key;
 };
 
+/* The colors a cell is drawn with. Selected cells and the cursor are
+ * drawn reversed. */
 static void
-terminal_decode_attr(struct terminal *terminal, int row, int col,
-		     union decoded_attr *decoded)
+decode_attr(struct terminal *terminal, struct attr attr,
+	    int selected, int reverse, union decoded_attr *decoded)
 {
-	struct attr attr;
 	int foreground, background, tmp;
 
-	decoded->attr.s = 0;
-	if (((row == terminal->selection_start_row &&
-	      col >= terminal->selection_start_col) ||
-	     row > terminal->selection_start_row) &&
-	    ((row == terminal->selection_end_row &&
-	      col < terminal->selection_end_col) ||
-	     row < terminal->selection_end_row))
-		decoded->attr.s = 1;
-
-	/* get the attributes for this character cell */
-	attr = terminal_get_attr_row(terminal, row)[col];
-	if ((attr.a & ATTRMASK_INVERSE) ||
-	    decoded->attr.s ||
-	    ((terminal->mode & MODE_SHOW_CURSOR) &&
-	     window_has_focus(terminal->window) && terminal->row == row &&
-	     terminal->column == col)) {
+	decoded->attr.s = selected;
+	if ((attr.a & ATTRMASK_INVERSE) || selected || reverse) {
 		foreground = attr.bg;
 		background = attr.fg;
 		if (attr.a & ATTRMASK_BOLD) {
@@ -629,6 +1154,98 @@ terminal_decode_attr(struct terminal *terminal, int row, int col,
 	decoded->attr.a = attr.a;
 }
 
+static void
+terminal_decode_attr(struct terminal *terminal, int row, int col,
+		     union decoded_attr *decoded)
+{
+	int selected, cursor;
+
+	selected = ((row == terminal->selection_start_row &&
+		     col >= terminal->selection_start_col) ||
+		    row > terminal->selection_start_row) &&
+		   ((row == terminal->selection_end_row &&
+		     col < terminal->selection_end_col) ||
+		    row < terminal->selection_end_row);
+
+	cursor = (terminal->mode & MODE_SHOW_CURSOR) &&
+		 terminal_has_focus(terminal) && terminal->row == row &&
+		 terminal->column == col;
+
+	decode_attr(terminal, terminal_get_attr_row(terminal, row)[col],
+		    selected, cursor, decoded);
+}
+
+/* The decoded attributes of a screen row, shared by the background
+ * and the foreground pass. The cursor is left out, so that the row
+ * stays valid while it moves; see terminal_cell_attr(). */
+static union decoded_attr *
+terminal_decoded_row(struct terminal *terminal, int row)
+{
+	union decoded_attr *decoded;
+	struct attr *attr_row;
+	int col, first, end;
+
+	decoded = terminal->decoded + row * terminal->max_width;
+	if (terminal->decoded_valid[row])
+		return decoded;
+
+	/* The selected columns [first, end) of the row */
+	if (row > terminal->selection_start_row)
+		first = 0;
+	else if (row == terminal->selection_start_row)
+		first = terminal->selection_start_col;
+	else
+		first = terminal->width;
+	if (row < terminal->selection_end_row)
+		end = terminal->width;
+	else if (row == terminal->selection_end_row)
+		end = terminal->selection_end_col;
+	else
+		end = 0;
+
+	attr_row = terminal_get_attr_row(terminal, row);
+	for (col = 0; col < terminal->width; col++)
+		decode_attr(terminal, attr_row[col],
+			    col >= first && col < end, 0, &decoded[col]);
+
+	terminal->decoded_valid[row] = 1;
+
+	return decoded;
+}
+
+static union decoded_attr
+terminal_cell_attr(struct terminal *terminal, union decoded_attr *decoded,
+		   int row, int col)
+{
+	union decoded_attr attr;
+
+	if (row == terminal->row && col == terminal->column)
+		terminal_decode_attr(terminal, row, col, &attr);
+	else
+		attr = decoded[col];
+
+	return attr;
+}
+
+
+/* Clear cells [start, end) of a screen row to the current attributes.
+ * Rows keep their cells past the width, see terminal_resize_cells(), so
+ * a clear that reaches the right edge takes those along; otherwise
+ * widening the window again would bring back what was erased. */
+static void
+terminal_clear_cells(struct terminal *terminal, int row, int start, int end)
+{
+	union utf8_char *data = terminal_get_row(terminal, row);
+	struct attr *attr = terminal_get_attr_row(terminal, row);
+
+	if (end >= terminal->width)
+		end = terminal->max_width;
+	if (start >= end)
+		return;
+
+	memset(&data[start], 0, (end - start) * sizeof(union utf8_char));
+	attr_init(&attr[start], terminal->curr_attr, end - start);
+}
 
 static void
 terminal_scroll_buffer(struct terminal *terminal, int d)
@@ -636,18 +1253,16 @@ terminal_scroll_buffer(struct terminal *terminal, int d)
 	int i;
 
 	terminal->start += d;
+	terminal_dirty_scroll(terminal, d);
 	if (d < 0) {
 		d = 0 - d;
 		for (i = 0; i < d; i++) {
-			memset(terminal_get_row(terminal, i), 0, terminal->data_pitch);
-			attr_init(terminal_get_attr_row(terminal, i),
-			    terminal->curr_attr, terminal->width);
+			terminal_clear_cells(terminal, i, 0, terminal->width);
 		}
 	} else {
 		for (i = terminal->height - d; i < terminal->height; i++) {
-			memset(terminal_get_row(terminal, i), 0, terminal->data_pitch);
-			attr_init(terminal_get_attr_row(terminal, i),
-			    terminal->curr_attr, terminal->width);
+			terminal_evict_row(terminal, i);
+			terminal_clear_cells(terminal, i, 0, terminal->width);
 		}
 	}
 
@@ -679,9 +1294,7 @@ terminal_scroll_window(struct terminal *terminal, int d)
 			       terminal->attr_pitch);
 		}
 		for (i = terminal->margin_top; i < (terminal->margin_top + d); i++) {
-			memset(terminal_get_row(terminal, i), 0, terminal->data_pitch);
-			attr_init(terminal_get_attr_row(terminal, i),
-				terminal->curr_attr, terminal->width);
+			terminal_clear_cells(terminal, i, 0, terminal->width);
 		}
 	} else {
 		to_row = terminal->margin_top;
@@ -696,11 +1309,12 @@ terminal_scroll_window(struct terminal *terminal, int d)
 			       terminal->attr_pitch);
 		}
 		for (i = terminal->margin_bottom - d + 1; i <= terminal->margin_bottom; i++) {
-			memset(terminal_get_row(terminal, i), 0, terminal->data_pitch);
-			attr_init(terminal_get_attr_row(terminal, i),
-				terminal->curr_attr, terminal->width);
+			terminal_clear_cells(terminal, i, 0, terminal->width);
 		}
 	}
+
+	terminal_dirty_rows(terminal, terminal->margin_top,
+			    terminal->margin_bottom + 1);
 }
 
 static void
@@ -733,8 +1347,8 @@ terminal_shift_line(struct terminal *terminal, int d)
 			(terminal->width - terminal->column - d) * sizeof(union utf8_char));
 		memmove(&attr_row[terminal->column], &attr_row[terminal->column + d],
 		        (terminal->width - terminal->column - d) * sizeof(struct attr));
-		memset(&row[terminal->width - d], 0, d * sizeof(union utf8_char));
-		attr_init(&attr_row[terminal->width - d], terminal->curr_attr, d);
+		terminal_clear_cells(terminal, terminal->row,
+				     terminal->width - d, terminal->width);
 	} else {
 		memmove(&row[terminal->column + d], &row[terminal->column],
 			(terminal->width - terminal->column - d) * sizeof(union utf8_char));
@@ -742,18 +1356,65 @@ terminal_shift_line(struct terminal *terminal, int d)
 			(terminal->width - terminal->column - d) * sizeof(struct attr));
 		memset(&row[terminal->column], 0, d * sizeof(union utf8_char));
 		attr_init(&attr_row[terminal->column], terminal->curr_attr, d);
+		/* What was shifted past the edge is gone */
+		terminal_clear_cells(terminal, terminal->row,
+				     terminal->width, terminal->width);
 	}
+
+	terminal_dirty_cells(terminal, terminal->row,
+			     terminal->column, terminal->width);
 }
 
+/* Make room for rows of at least the given width. The ring is
+ * reallocated with headroom, so that widening a window step by step
+ * only copies it now and then; all of it is kept, slot by slot. */
 static void
-terminal_resize_cells(struct terminal *terminal,
-		      int width, int height)
+terminal_grow_cells(struct terminal *terminal, int width)
 {
 	union utf8_char *data;
 	struct attr *data_attr;
 	char *tab_ruler;
-	int data_pitch, attr_pitch;
-	int i, l, total_rows;
+	int data_pitch, attr_pitch, max_width;
+	uint32_t i;
+
+	max_width = MAX(width, terminal->max_width + terminal->max_width / 2);
+	data_pitch = max_width * sizeof(union utf8_char);
+	data = xzalloc(data_pitch * terminal->buffer_height);
+	attr_pitch = max_width * sizeof(struct attr);
+	data_attr = xmalloc(attr_pitch * terminal->buffer_height);
+	tab_ruler = xzalloc(max_width);
+	attr_init(data_attr, terminal->curr_attr,
+		  max_width * terminal->buffer_height);
+
+	if (terminal->data) {
+		for (i = 0; i < terminal->buffer_height; i++) {
+			memcpy((void *) data + i * data_pitch,
+			       (void *) terminal->data +
+			       i * terminal->data_pitch,
+			       terminal->data_pitch);
+			memcpy((void *) data_attr + i * attr_pitch,
+			       (void *) terminal->data_attr +
+			       i * terminal->attr_pitch,
+			       terminal->attr_pitch);
+		}
+
+		free(terminal->data);
+		free(terminal->data_attr);
+		free(terminal->tab_ruler);
+	}
+
+	terminal->max_width = max_width;
+	terminal->data_pitch = data_pitch;
+	terminal->attr_pitch = attr_pitch;
+	terminal->data = data;
+	terminal->data_attr = data_attr;
+	terminal->tab_ruler = tab_ruler;
+}
+
+static void
+terminal_resize_cells(struct terminal *terminal,
+		      int width, int height)
+{
 	uint32_t d, uheight = height;
 	struct rectangle allocation;
 	struct winsize ws;
@@ -764,74 +1425,42 @@ terminal_resize_cells(struct terminal *terminal,
 	if (terminal->width == width && terminal->height == height)
 		return;
 
-	if (terminal->data && width <= terminal->max_width) {
-		d = 0;
-		if (height < terminal->height && height <= terminal->row)
-			d = terminal->height - height;
-		else if (height > terminal->height &&
-			 terminal->height - 1 == terminal->row) {
-			d = terminal->height - height;
-			if (terminal->log_size < uheight)
-				d = -terminal->start;
-		}
-
-		terminal->start += d;
-		terminal->row -= d;
-	} else {
-		terminal->max_width = width;
-		data_pitch = width * sizeof(union utf8_char);
-		data = xzalloc(data_pitch * terminal->buffer_height);
-		attr_pitch = width * sizeof(struct attr);
-		data_attr = xmalloc(attr_pitch * terminal->buffer_height);
-		tab_ruler = xzalloc(width);
-		attr_init(data_attr, terminal->curr_attr,
-			  width * terminal->buffer_height);
-
-		if (terminal->data && terminal->data_attr) {
-			if (width > terminal->width)
-				l = terminal->width;
-			else
-				l = width;
-
-			if (terminal->height > height) {
-				total_rows = height;
-				i = 1 + terminal->row - height;
-				if (i > 0) {
-					terminal->start += i;
-					terminal->row = terminal->row - i;
-				}
-			} else {
-				total_rows = terminal->height;
-			}
-
-			for (i = 0; i < total_rows; i++) {
-				memcpy(&data[width * i],
-				       terminal_get_row(terminal, i),
-				       l * sizeof(union utf8_char));
-				memcpy(&data_attr[width * i],
-				       terminal_get_attr_row(terminal, i),
-				       l * sizeof(struct attr));
-			}
-
-			free(terminal->data);
-			free(terminal->data_attr);
-			free(terminal->tab_ruler);
-		}
-
-		terminal->data_pitch = data_pitch;
-		terminal->attr_pitch = attr_pitch;
-		terminal->data = data;
-		terminal->data_attr = data_attr;
-		terminal->tab_ruler = tab_ruler;
-		terminal->start = 0;
+	/* Rows keep their cells past the width, so narrowing and
+	 * widening again only changes how much of them is shown */
+	if (!terminal->data || width > terminal->max_width)
+		terminal_grow_cells(terminal, width);
+
+	d = 0;
+	if (height < terminal->height && height <= terminal->row)
+		d = terminal->height - height;
+	else if (height > terminal->height &&
+		 terminal->height - 1 == terminal->row) {
+		d = terminal->height - height;
+		if (terminal->log_size < uheight)
+			d = -terminal->start;
 	}
 
+	terminal->start += d;
+	terminal->row -= d;
+
 	terminal->margin_bottom =
 		height - (terminal->height - terminal->margin_bottom);
 	terminal->width = width;
 	terminal->height = height;
 	terminal_init_tabs(terminal);
 
+	/* Per screen row, all of them reset by dirty_all() */
+	terminal->dirty = xrealloc(terminal->dirty,
+				   height * sizeof terminal->dirty[0]);
+	terminal->decoded = xrealloc(terminal->decoded,
+				     terminal->max_width * height *
+				     sizeof terminal->decoded[0]);
+	terminal->decoded_valid = xrealloc(terminal->decoded_valid, height);
+	terminal_dirty_all(terminal);
+
+	if (!terminal->window)
+		return;
+
 	/* Update the window size */
 	ws.ws_row = terminal->height;
 	ws.ws_col = terminal->width;
@@ -844,7 +1473,15 @@ terminal_resize_cells(struct terminal *terminal,
 static void
 update_title(struct terminal *terminal)
 {
-	if (window_is_resizing(terminal->window)) {
+	if (terminal->searching) {
+		char *p;
+		if (asprintf(&p, "%s — %s: %s", terminal->title,
+			     terminal->search_failed ? "Not found" : "Search",
+			     terminal->search_query) > 0) {
+			window_set_title(terminal->window, p);
+			free(p);
+		}
+	} else if (window_is_resizing(terminal->window)) {
 		char *p;
 		if (asprintf(&p, "%s — [%dx%d]", terminal->title, terminal->width, terminal->height) > 0) {
 			window_set_title(terminal->window, p);
@@ -878,6 +1515,7 @@ resize_handler(struct widget *widget,
 	}
 
 	terminal_resize_cells(terminal, columns, rows);
+	terminal_dirty_all(terminal);
 	update_title(terminal);
 }
 
@@ -893,7 +1531,8 @@ terminal_resize(struct terminal *terminal, int columns, int rows)
 {
 	int32_t width, height, m;
 
-	if (window_is_fullscreen(terminal->window) ||
+	if (!terminal->window ||
+	    window_is_fullscreen(terminal->window) ||
 	    window_is_maximized(terminal->window))
 		return;
 
@@ -1013,104 +1652,237 @@ glyph_run_flush(struct glyph_run *run, union decoded_attr attr)
 	run->attr = attr;
 }
 
+static struct glyph_cache_entry *
+terminal_lookup_glyphs(struct terminal *terminal, cairo_scaled_font_t *font,
+		       union utf8_char *c)
+{
+	struct glyph_cache_entry *entry;
+	cairo_glyph_t *glyphs;
+	cairo_status_t status;
+	uint32_t hash;
+	int num_glyphs;
+
+	hash = c->ch * 0x9e3779b1;
+	if (font == terminal->font_bold)
+		hash ^= 0x5bd1e995;
+	entry = &terminal->glyph_cache[(hash >> 16) & (GLYPH_CACHE_SIZE - 1)];
+
+	if (entry->font == font && entry->c.ch == c->ch)
+		return entry;
+
+	glyphs = entry->glyphs;
+	num_glyphs = ARRAY_LENGTH(entry->glyphs);
+	status = cairo_scaled_font_text_to_glyphs(font, 0, 0,
+						  (char *) c->byte, 4,
+						  &glyphs, &num_glyphs,
+						  NULL, NULL, NULL);
+	if (status != CAIRO_STATUS_SUCCESS)
+		num_glyphs = 0;
+
+	if (glyphs != entry->glyphs) {
+		if (num_glyphs > (int) ARRAY_LENGTH(entry->glyphs))
+			num_glyphs = ARRAY_LENGTH(entry->glyphs);
+		memcpy(entry->glyphs, glyphs, num_glyphs * sizeof *glyphs);
+		cairo_glyph_free(glyphs);
+	}
+
+	entry->font = font;
+	entry->c = *c;
+	entry->num_glyphs = num_glyphs;
+
+	return entry;
+}
+
 static void
 glyph_run_add(struct glyph_run *run, int x, int y, union utf8_char *c)
 {
-	int num_glyphs;
+	struct glyph_cache_entry *entry;
 	cairo_scaled_font_t *font;
-
-	num_glyphs = ARRAY_LENGTH(run->glyphs) - run->count;
+	int i;
 
 	if (run->attr.attr.a & (ATTRMASK_BOLD | ATTRMASK_BLINK))
 		font = run->terminal->font_bold;
 	else
 		font = run->terminal->font_normal;
 
-	cairo_move_to(run->cr, x, y);
-	cairo_scaled_font_text_to_glyphs (font, x, y,
-					  (char *) c->byte, 4,
-					  &run->g, &num_glyphs,
-					  NULL, NULL, NULL);
-	run->g += num_glyphs;
-	run->count += num_glyphs;
+	entry = terminal_lookup_glyphs(run->terminal, font, c);
+	for (i = 0; i < entry->num_glyphs; i++) {
+		run->g[i].index = entry->glyphs[i].index;
+		run->g[i].x = entry->glyphs[i].x + x;
+		run->g[i].y = entry->glyphs[i].y + y;
+	}
+	run->g += entry->num_glyphs;
+	run->count += entry->num_glyphs;
 }
 
 
+/* Report the dirty spans as damage and clear them. Spans are widened
+ * by a cell on each side for glyphs overhanging their cell. */
 static void
-redraw_handler(struct widget *widget, void *data)
+terminal_damage_dirty(struct terminal *terminal,
+		      struct rectangle *allocation,
+		      int side_margin, int top_margin)
+{
+	struct rectangle rect;
+	struct dirty_span *span;
+	int row, x1, x2;
+
+	/* The cursor is drawn into its cell, so redraw where it was
+	 * and where it is now */
+	terminal_dirty_cells(terminal, terminal->cursor_drawn_row,
+			     terminal->cursor_drawn_column,
+			     terminal->cursor_drawn_column + 1);
+	terminal_dirty_cells(terminal, terminal->row,
+			     terminal->column, terminal->column + 1);
+	terminal->cursor_drawn_row = terminal->row;
+	terminal->cursor_drawn_column = terminal->column;
+
+	for (row = 0; row < terminal->height; row++) {
+		span = &terminal->dirty[row];
+		if (span->start >= span->end)
+			continue;
+
+		x1 = allocation->x + side_margin +
+			(span->start - 1) * terminal->average_width;
+		x2 = allocation->x + side_margin +
+			(span->end + 1) * terminal->average_width;
+		if (span->start == 0)
+			x1 = allocation->x;
+		if (span->end >= terminal->width)
+			x2 = allocation->x + allocation->width;
+
+		rect.x = x1;
+		rect.y = allocation->y + top_margin +
+			row * terminal->extents.height;
+		rect.width = x2 - x1;
+		rect.height = terminal->extents.height;
+		widget_damage_region(terminal->widget, &rect);
+
+		span->start = span->end = 0;
+	}
+}
+
+/* Whether part of the row is inside the clip, NULL meaning no clip */
+static int
+row_in_clip(cairo_rectangle_list_t *clip, double y, double height)
+{
+	cairo_rectangle_t *r;
+	int i;
+
+	if (!clip || clip->status != CAIRO_STATUS_SUCCESS)
+		return 1;
+
+	for (i = 0; i < clip->num_rectangles; i++) {
+		r = &clip->rectangles[i];
+		if (r->y < y + height && y < r->y + r->height)
+			return 1;
+	}
+
+	return 0;
+}
+
+/* Draw the cells into the allocation, skipping rows outside of the
+ * clip of cr */
+static void
+terminal_draw(struct terminal *terminal, cairo_t *cr,
+	      struct rectangle *allocation)
 {
-	struct terminal *terminal = data;
-	struct rectangle allocation;
-	cairo_t *cr;
 	int top_margin, side_margin;
-	int row, col, cursor_x, cursor_y;
+	int row, col;
 	union utf8_char *p_row;
-	union decoded_attr attr;
+	union decoded_attr attr, *decoded;
 	int text_x, text_y;
-	cairo_surface_t *surface;
 	double d;
 	struct glyph_run run;
 	cairo_font_extents_t extents;
 	double average_width;
-	double unichar_width;
+	int bg, run_bg, fill_bg, run_start;
+	cairo_rectangle_list_t *clip;
 
-	surface = window_get_surface(terminal->window);
-	widget_get_allocation(terminal->widget, &allocation);
-	cr = widget_cairo_create(terminal->widget);
-	cairo_rectangle(cr, allocation.x, allocation.y,
-			allocation.width, allocation.height);
+	extents = terminal->extents;
+	average_width = terminal->average_width;
+
+	side_margin = (allocation->width - terminal->width * average_width) / 2;
+	top_margin = (allocation->height - terminal->height * extents.height) / 2;
+
+	cairo_save(cr);
+	cairo_rectangle(cr, allocation->x, allocation->y,
+			allocation->width, allocation->height);
 	cairo_clip(cr);
-	cairo_push_group(cr);
 
+	/* Drawn straight into the buffer, which is not on screen until
+	 * it is attached: the background replaces what was there, so
+	 * the result is the same as composing it in a group first. */
 	cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
 	terminal_set_color(terminal, cr, terminal->color_scheme->border);
 	cairo_paint(cr);
 
 	cairo_set_scaled_font(cr, terminal->font_normal);
 
-	extents = terminal->extents;
-	average_width = terminal->average_width;
-	side_margin = (allocation.width - terminal->width * average_width) / 2;
-	top_margin = (allocation.height - terminal->height * extents.height) / 2;
-
 	cairo_set_line_width(cr, 1.0);
-	cairo_translate(cr, allocation.x + side_margin,
-			allocation.y + top_margin);
-	/* paint the background */
+	cairo_translate(cr, allocation->x + side_margin,
+			allocation->y + top_margin);
+	clip = cairo_copy_clip_rectangle_list(cr);
+
+	/* paint the background: one rectangle per run of cells sharing
+	 * a color, filled together until the color changes */
+	fill_bg = -1;
 	for (row = 0; row < terminal->height; row++) {
+		if (!row_in_clip(clip, row * extents.height, extents.height))
+			continue;
 		p_row = terminal_get_row(terminal, row);
-		for (col = 0; col < terminal->width; col++) {
-			/* get the attributes for this character cell */
-			terminal_decode_attr(terminal, row, col, &attr);
+		decoded = terminal_decoded_row(terminal, row);
+		run_bg = -1;
+		run_start = 0;
+		for (col = 0; col <= terminal->width; col++) {
+			bg = -1;
+			if (col < terminal->width) {
+				/* get the attributes for this character cell */
+				attr = terminal_cell_attr(terminal, decoded,
+							  row, col);
+				bg = attr.attr.bg;
+				/* the right half of a double-width character */
+				if (bg == terminal->color_scheme->border &&
+				    p_row[col].ch == 0x200B && col > 0 &&
+				    is_wide(p_row[col - 1]))
+					bg = run_bg;
+			}
 
-			if (attr.attr.bg == terminal->color_scheme->border)
+			if (bg == run_bg)
 				continue;
 
-			if (is_wide(p_row[col]))
-				unichar_width = 2 * average_width;
-			else
-				unichar_width = average_width;
-
-			terminal_set_color(terminal, cr, attr.attr.bg);
-			cairo_move_to(cr, col * average_width,
-				      row * extents.height);
-			cairo_rel_line_to(cr, unichar_width, 0);
-			cairo_rel_line_to(cr, 0, extents.height);
-			cairo_rel_line_to(cr, -unichar_width, 0);
-			cairo_close_path(cr);
-			cairo_fill(cr);
+			if (run_bg >= 0 &&
+			    run_bg != terminal->color_scheme->border) {
+				if (run_bg != fill_bg) {
+					if (fill_bg >= 0)
+						cairo_fill(cr);
+					terminal_set_color(terminal, cr, run_bg);
+					fill_bg = run_bg;
+				}
+				cairo_rectangle(cr, run_start * average_width,
+						row * extents.height,
+						(col - run_start) * average_width,
+						extents.height);
+			}
+			run_bg = bg;
+			run_start = col;
 		}
 	}
+	if (fill_bg >= 0)
+		cairo_fill(cr);
 
 	cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
 
 	/* paint the foreground */
 	glyph_run_init(&run, terminal, cr);
 	for (row = 0; row < terminal->height; row++) {
+		if (!row_in_clip(clip, row * extents.height, extents.height))
+			continue;
 		p_row = terminal_get_row(terminal, row);
+		decoded = terminal_decoded_row(terminal, row);
 		for (col = 0; col < terminal->width; col++) {
 			/* get the attributes for this character cell */
-			terminal_decode_attr(terminal, row, col, &attr);
+			attr = terminal_cell_attr(terminal, decoded, row, col);
 
 			glyph_run_flush(&run, attr);
 
@@ -1137,7 +1909,7 @@ redraw_handler(struct widget *widget, void *data)
 	glyph_run_flush(&run, attr);
 
 	if ((terminal->mode & MODE_SHOW_CURSOR) &&
-	    !window_has_focus(terminal->window)) {
+	    !terminal_has_focus(terminal)) {
 		d = 0.5;
 
 		cairo_set_line_width(cr, 1);
@@ -1151,8 +1923,64 @@ redraw_handler(struct widget *widget, void *data)
 		cairo_stroke(cr);
 	}
 
-	cairo_pop_group_to_source(cr);
-	cairo_paint(cr);
+	cairo_rectangle_list_destroy(clip);
+	cairo_restore(cr);
+}
+
+/* Runs before the frame around the terminal draws, so that the
+ * damage reported here is part of the clip of the whole window and
+ * rows outside of it are left as they are in the buffer. */
+static void
+prepare_redraw_handler(struct widget *widget, void *data)
+{
+	struct terminal *terminal = data;
+	struct rectangle allocation, rect;
+	int top_margin, side_margin;
+
+	widget_get_allocation(terminal->widget, &allocation);
+	side_margin = (allocation.width -
+		       terminal->width * terminal->average_width) / 2;
+	top_margin = (allocation.height -
+		      terminal->height * terminal->extents.height) / 2;
+
+	/* Move what was drawn before scrolling along in the buffer */
+	if (terminal->scrolled) {
+		rect.x = allocation.x;
+		rect.y = allocation.y + top_margin;
+		rect.width = allocation.width;
+		rect.height = terminal->height * terminal->extents.height;
+		if (!widget_scroll_region(widget, &rect,
+					  -terminal->scrolled *
+					  terminal->extents.height))
+			terminal_dirty_all(terminal);
+		terminal->scrolled = 0;
+	}
+
+	terminal_damage_dirty(terminal, &allocation, side_margin, top_margin);
+}
+
+static void
+redraw_handler(struct widget *widget, void *data)
+{
+	struct terminal *terminal = data;
+	struct rectangle allocation;
+	cairo_t *cr;
+	int top_margin, side_margin;
+	int cursor_x, cursor_y;
+	cairo_surface_t *surface;
+	cairo_font_extents_t extents;
+	double average_width;
+
+	extents = terminal->extents;
+	average_width = terminal->average_width;
+
+	surface = window_get_surface(terminal->window);
+	widget_get_allocation(terminal->widget, &allocation);
+	side_margin = (allocation.width - terminal->width * average_width) / 2;
+	top_margin = (allocation.height - terminal->height * extents.height) / 2;
+
+	cr = widget_cairo_create(terminal->widget);
+	terminal_draw(terminal, cr, &allocation);
 	cairo_destroy(cr);
 	cairo_surface_destroy(surface);
 
@@ -1184,6 +2012,29 @@ handle_char(struct terminal *terminal, union utf8_char utf8);
 static void
 handle_sgr(struct terminal *terminal, int code);
 
+/* Between the start and the end of a synchronized update output
+ * doesn't schedule redraws, so that the screen only shows whole
+ * frames. The update ends by itself SYNC_TIMEOUT_USEC after it began;
+ * starting it again while it runs doesn't push that back. */
+static void
+terminal_synchronize(struct terminal *terminal, int sr)
+{
+	if (sr) {
+		if (terminal->mode & MODE_SYNCHRONIZED)
+			return;
+		terminal->mode |= MODE_SYNCHRONIZED;
+		if (terminal->window)
+			toytimer_arm_once_usec(&terminal->sync_timer,
+					       SYNC_TIMEOUT_USEC);
+	} else if (terminal->mode & MODE_SYNCHRONIZED) {
+		terminal->mode &= ~MODE_SYNCHRONIZED;
+		if (terminal->window) {
+			toytimer_disarm(&terminal->sync_timer);
+			window_schedule_redraw(terminal->window);
+		}
+	}
+}
+
 static void
 handle_term_parameter(struct terminal *terminal, int code, int sr)
 {
@@ -1210,15 +2061,14 @@ handle_term_parameter(struct terminal *terminal, int code, int sr)
 			/* set columns, but also home cursor and clear screen */
 			terminal->row = 0; terminal->column = 0;
 			for (i = 0; i < terminal->height; i++) {
-				memset(terminal_get_row(terminal, i),
-				    0, terminal->data_pitch);
-				attr_init(terminal_get_attr_row(terminal, i),
-				    terminal->curr_attr, terminal->width);
+				terminal_clear_cells(terminal, i, 0, terminal->width);
 			}
+			terminal_dirty_all(terminal);
 			break;
 		case 5:  /* DECSCNM */
 			if (sr)	terminal->mode |=  MODE_INVERSE;
 			else	terminal->mode &= ~MODE_INVERSE;
+			terminal_dirty_all(terminal);
 			break;
 		case 6:  /* DECOM */
 			terminal->origin_mode = sr;
@@ -1254,6 +2104,9 @@ handle_term_parameter(struct terminal *terminal, int code, int sr)
 			if (sr)	terminal->mode |=  MODE_ALT_SENDS_ESC;
 			else	terminal->mode &= ~MODE_ALT_SENDS_ESC;
 			break;
+		case 2026:   /* Synchronized update */
+			terminal_synchronize(terminal, sr);
+			break;
 		case 1049:   /* rmcup/smcup, alternate screen */
 			/* Ignore.  Should be possible to implement,
 			 * but it's kind of annoying. */
@@ -1301,7 +2154,8 @@ handle_osc(struct terminal *terminal)
 	case 2: /* Window title*/
 		free(terminal->title);
 		terminal->title = strdup(p);
-		window_set_title(terminal->window, p);
+		if (terminal->window)
+			window_set_title(terminal->window, p);
 		break;
 	case 7: /* shell cwd as uri */
 		break;
@@ -1317,8 +2171,6 @@ handle_osc(struct terminal *terminal)
 static void
 handle_escape(struct terminal *terminal)
 {
-	union utf8_char *row;
-	struct attr *attr_row;
 	char *p;
 	int i, count, x, y, top, bottom;
 	int args[10], set[10] = { 0, };
@@ -1431,28 +2283,21 @@ handle_escape(struct terminal *terminal)
 		terminal->column--;
 		break;
 	case 'J':    /* ED - Erase display */
-		row = terminal_get_row(terminal, terminal->row);
-		attr_row = terminal_get_attr_row(terminal, terminal->row);
 		if (!set[0] || args[0] == 0 || args[0] > 2) {
-			memset(&row[terminal->column],
-			       0, (terminal->width - terminal->column) * sizeof(union utf8_char));
-			attr_init(&attr_row[terminal->column],
-			       terminal->curr_attr, terminal->width - terminal->column);
+			terminal_clear_cells(terminal, terminal->row,
+					     terminal->column, terminal->width);
 			for (i = terminal->row + 1; i < terminal->height; i++) {
-				memset(terminal_get_row(terminal, i),
-				    0, terminal->data_pitch);
-				attr_init(terminal_get_attr_row(terminal, i),
-				    terminal->curr_attr, terminal->width);
+				terminal_clear_cells(terminal, i, 0, terminal->width);
 			}
+			terminal_dirty_rows(terminal, terminal->row,
+					    terminal->height);
 		} else if (args[0] == 1) {
-			memset(row, 0, (terminal->column+1) * sizeof(union utf8_char));
-			attr_init(attr_row, terminal->curr_attr, terminal->column+1);
+			terminal_clear_cells(terminal, terminal->row,
+					     0, terminal->column + 1);
 			for (i = 0; i < terminal->row; i++) {
-				memset(terminal_get_row(terminal, i),
-				    0, terminal->data_pitch);
-				attr_init(terminal_get_attr_row(terminal, i),
-				    terminal->curr_attr, terminal->width);
+				terminal_clear_cells(terminal, i, 0, terminal->width);
 			}
+			terminal_dirty_rows(terminal, 0, terminal->row + 1);
 		} else if (args[0] == 2) {
 			/* Clear screen by scrolling contents out */
 			terminal_scroll_buffer(terminal,
@@ -1460,20 +2305,17 @@ handle_escape(struct terminal *terminal)
 		}
 		break;
 	case 'K':    /* EL - Erase line */
-		row = terminal_get_row(terminal, terminal->row);
-		attr_row = terminal_get_attr_row(terminal, terminal->row);
 		if (!set[0] || args[0] == 0 || args[0] > 2) {
-			memset(&row[terminal->column], 0,
-			    (terminal->width - terminal->column) * sizeof(union utf8_char));
-			attr_init(&attr_row[terminal->column], terminal->curr_attr,
-			    terminal->width - terminal->column);
+			terminal_clear_cells(terminal, terminal->row,
+					     terminal->column, terminal->width);
 		} else if (args[0] == 1) {
-			memset(row, 0, (terminal->column+1) * sizeof(union utf8_char));
-			attr_init(attr_row, terminal->curr_attr, terminal->column+1);
+			terminal_clear_cells(terminal, terminal->row,
+					     0, terminal->column + 1);
 		} else if (args[0] == 2) {
-			memset(row, 0, terminal->data_pitch);
-			attr_init(attr_row, terminal->curr_attr, terminal->width);
+			terminal_clear_cells(terminal, terminal->row,
+					     0, terminal->width);
 		}
+		terminal_dirty_rows(terminal, terminal->row, terminal->row + 1);
 		break;
 	case 'L':    /* IL - Insert <count> blank lines */
 		count = set[0] ? args[0] : 1;
@@ -1486,10 +2328,10 @@ handle_escape(struct terminal *terminal)
 			terminal_scroll(terminal, 0 - count);
 			terminal->margin_top = top;
 		} else if (terminal->row == terminal->margin_bottom) {
-			memset(terminal_get_row(terminal, terminal->row),
-			       0, terminal->data_pitch);
-			attr_init(terminal_get_attr_row(terminal, terminal->row),
-				terminal->curr_attr, terminal->width);
+			terminal_clear_cells(terminal, terminal->row,
+					     0, terminal->width);
+			terminal_dirty_rows(terminal, terminal->row,
+					    terminal->row + 1);
 		}
 		break;
 	case 'M':    /* DL - Delete <count> lines */
@@ -1503,8 +2345,10 @@ handle_escape(struct terminal *terminal)
 			terminal_scroll(terminal, count);
 			terminal->margin_top = top;
 		} else if (terminal->row == terminal->margin_bottom) {
-			memset(terminal_get_row(terminal, terminal->row),
-			       0, terminal->data_pitch);
+			terminal_clear_cells(terminal, terminal->row,
+					     0, terminal->width);
+			terminal_dirty_rows(terminal, terminal->row,
+					    terminal->row + 1);
 		}
 		break;
 	case 'P':    /* DCH - Delete <count> characters on current line */
@@ -1523,10 +2367,10 @@ handle_escape(struct terminal *terminal)
 		if (count == 0) count = 1;
 		if ((terminal->column + count) > terminal->width)
 			count = terminal->width - terminal->column;
-		row = terminal_get_row(terminal, terminal->row);
-		attr_row = terminal_get_attr_row(terminal, terminal->row);
-		memset(&row[terminal->column], 0, count * sizeof(union utf8_char));
-		attr_init(&attr_row[terminal->column], terminal->curr_attr, count);
+		terminal_clear_cells(terminal, terminal->row, terminal->column,
+				     terminal->column + count);
+		terminal_dirty_cells(terminal, terminal->row, terminal->column,
+				     terminal->column + count);
 		break;
 	case 'Z':    /* CBT */
 		count = set[0] ? args[0] : 1;
@@ -1577,6 +2421,19 @@ handle_escape(struct terminal *terminal)
 			handle_term_parameter(terminal, args[i], 0);
 		}
 		break;
+	case 'p':    /* DECRQM - Request mode */
+		if ((terminal->escape_flags & ESC_FLAG_WHAT) &&
+		    (terminal->escape_flags & ESC_FLAG_CASH) && set[0]) {
+			/* only synchronized updates are reported, as set
+			 * (1) or reset (2); other modes as unknown (0) */
+			x = 0;
+			if (args[0] == 2026)
+				x = (terminal->mode & MODE_SYNCHRONIZED) ? 1 : 2;
+			snprintf(response, MAX_RESPONSE, "\e[?%d;%d$y",
+				 args[0], x);
+			terminal_write(terminal, response, strlen(response));
+		}
+		break;
 	case 'm':    /* SGR - Set attributes */
 		for (i = 0; i < 10; i++) {
 			if (i <= 7 && set[i] && set[i + 1] &&
@@ -1644,7 +2501,7 @@ handle_escape(struct terminal *terminal)
 		terminal->saved_column = terminal->column;
 		break;
 	case 't':    /* windowOps */
-		if (!set[0]) break;
+		if (!set[0] || !terminal->window) break;
 		switch (args[0]) {
 		case 4:  /* resize px */
 			if (set[1] && set[2]) {
@@ -1720,6 +2577,7 @@ handle_non_csi_escape(struct terminal *terminal, char code)
 		break;
 	case 'c':    /* RIS - Reset*/
 		terminal_init(terminal);
+		terminal_dirty_all(terminal);
 		break;
 	case 'H':    /* HTS - Set tab stop at current column */
 		terminal->tab_ruler[terminal->column] = 1;
@@ -1768,6 +2626,7 @@ handle_special_escape(struct terminal *terminal, char special, char code)
 			for (i = 0; i < numChars; i++) {
 				terminal->data[i].byte[0] = 'E';
 			}
+			terminal_dirty_all(terminal);
 			break;
 		default:
 			fprintf(stderr, "Unknown HASH escape #%c\n", code);
@@ -1954,11 +2813,42 @@ handle_special_char(struct terminal *terminal, char c)
 	return 1;
 }
 
+/* handle right margin effects */
+static void
+terminal_wrap(struct terminal *terminal)
+{
+	if (terminal->column >= terminal->width) {
+		if (terminal->mode & MODE_AUTOWRAP) {
+			terminal->column = 0;
+			terminal->row += 1;
+			if (terminal->row > terminal->margin_bottom) {
+				terminal->row = terminal->margin_bottom;
+				terminal_scroll(terminal, +1);
+			}
+		} else {
+			terminal->column--;
+		}
+	}
+}
+
+/* Grow the log to include the cursor row */
+static void
+terminal_extend_log(struct terminal *terminal)
+{
+	if (terminal->row + terminal->start + 1 > terminal->end)
+		terminal->end = terminal->row + terminal->start + 1;
+	if (terminal->end == terminal->buffer_height)
+		terminal->log_size = terminal->buffer_height;
+	else if (terminal->log_size < terminal->buffer_height)
+		terminal->log_size = terminal->end;
+}
+
 static void
 handle_char(struct terminal *terminal, union utf8_char utf8)
 {
 	union utf8_char *row;
 	struct attr *attr_row;
+	int column;
 
 	if (handle_special_char(terminal, utf8.byte[0])) return;
 
@@ -1977,60 +2867,131 @@ handle_char(struct terminal *terminal, union utf8_char utf8)
 		utf8.byte[0] = utf8.byte[0] + 64;
 	}
 
-	/* handle right margin effects */
-	if (terminal->column >= terminal->width) {
-		if (terminal->mode & MODE_AUTOWRAP) {
-			terminal->column = 0;
-			terminal->row += 1;
-			if (terminal->row > terminal->margin_bottom) {
-				terminal->row = terminal->margin_bottom;
-				terminal_scroll(terminal, +1);
-			}
-		} else {
-			terminal->column--;
- 		}
- 	}
+	terminal_wrap(terminal);
 
 	row = terminal_get_row(terminal, terminal->row);
 	attr_row = terminal_get_attr_row(terminal, terminal->row);
 
 	if (terminal->mode & MODE_IRM)
 		terminal_shift_line(terminal, +1);
+	column = terminal->column;
 	row[terminal->column] = utf8;
 	attr_row[terminal->column++] = terminal->curr_attr;
 
-	if (terminal->row + terminal->start + 1 > terminal->end)
-		terminal->end = terminal->row + terminal->start + 1;
-	if (terminal->end == terminal->buffer_height)
-		terminal->log_size = terminal->buffer_height;
-	else if (terminal->log_size < terminal->buffer_height)
-		terminal->log_size = terminal->end;
+	terminal_extend_log(terminal);
 
 	/* cursor jump for wide character. */
 	if (is_wide(utf8))
 		row[terminal->column++].ch = 0x200B; /* space glyph */
 
+	terminal_dirty_cells(terminal, terminal->row, column, terminal->column);
+
 	if (utf8.ch != terminal->last_char.ch)
 		terminal->last_char = utf8;
 }
 
 static void
-escape_append_utf8(struct terminal *terminal, union utf8_char utf8)
+escape_append_utf8(struct terminal *terminal, union utf8_char utf8)
+{
+	int len, i;
+
+	if ((utf8.byte[0] & 0x80) == 0x00)       len = 1;
+	else if ((utf8.byte[0] & 0xE0) == 0xC0)  len = 2;
+	else if ((utf8.byte[0] & 0xF0) == 0xE0)  len = 3;
+	else if ((utf8.byte[0] & 0xF8) == 0xF0)  len = 4;
+	else                                     len = 1;  /* Invalid, cannot happen */
+
+	if (terminal->escape_length + len <= MAX_ESCAPE) {
+		for (i = 0; i < len; i++)
+			terminal->escape[terminal->escape_length + i] = utf8.byte[i];
+		terminal->escape_length += len;
+	} else if (terminal->escape_length < MAX_ESCAPE) {
+		terminal->escape[terminal->escape_length++] = 0;
+	}
+}
+
+/* Length of the run of printable ASCII characters at the start of
+ * data, none of which needs the escape or UTF-8 parser. */
+static size_t
+ascii_run_length(const char *data, size_t length)
+{
+	size_t i = 0;
+#ifdef __SSE2__
+	const __m128i space = _mm_set1_epi8(0x1f);
+	const __m128i del = _mm_set1_epi8(0x7f);
+	__m128i v, printable;
+	int mask;
+
+	/* Bytes are compared as signed, so non-ASCII ones are below
+	 * the space as well */
+	for (; i + 16 <= length; i += 16) {
+		v = _mm_loadu_si128((const __m128i *) (data + i));
+		printable = _mm_and_si128(_mm_cmpgt_epi8(v, space),
+					  _mm_cmplt_epi8(v, del));
+		mask = _mm_movemask_epi8(printable);
+		if (mask != 0xffff)
+			return i + __builtin_ctz(~mask);
+	}
+#endif
+
+	for (; i < length; i++) {
+		if ((unsigned char) data[i] < 0x20 ||
+		    (unsigned char) data[i] > 0x7e)
+			break;
+	}
+
+	return i;
+}
+
+/* Whether printable ASCII can bypass handle_char() */
+static bool
+terminal_ascii_fast_path(struct terminal *terminal)
+{
+	enum utf8_state utf8_state = terminal->state_machine.state;
+
+	return terminal->state == escape_state_normal &&
+	       (utf8_state == utf8state_start ||
+		utf8_state == utf8state_accept ||
+		utf8_state == utf8state_reject) &&
+	       terminal->cs == CS_US &&
+	       (terminal->mode & (MODE_AUTOWRAP | MODE_IRM)) == MODE_AUTOWRAP &&
+	       terminal->width > 0;
+}
+
+/* Write a run of printable ASCII with the current attributes, as
+ * handle_char() would one at a time. */
+static void
+terminal_put_ascii(struct terminal *terminal, const char *data, size_t length)
 {
-	int len, i;
+	union utf8_char *row;
+	struct attr *attr_row;
+	int i, n;
 
-	if ((utf8.byte[0] & 0x80) == 0x00)       len = 1;
-	else if ((utf8.byte[0] & 0xE0) == 0xC0)  len = 2;
-	else if ((utf8.byte[0] & 0xF0) == 0xE0)  len = 3;
-	else if ((utf8.byte[0] & 0xF8) == 0xF0)  len = 4;
-	else                                     len = 1;  /* Invalid, cannot happen */
+	terminal->last_char.ch = 0;
+	terminal->last_char.byte[0] = data[length - 1];
 
-	if (terminal->escape_length + len <= MAX_ESCAPE) {
-		for (i = 0; i < len; i++)
-			terminal->escape[terminal->escape_length + i] = utf8.byte[i];
-		terminal->escape_length += len;
-	} else if (terminal->escape_length < MAX_ESCAPE) {
-		terminal->escape[terminal->escape_length++] = 0;
+	while (length > 0) {
+		terminal_wrap(terminal);
+
+		n = terminal->width - terminal->column;
+		if ((size_t) n > length)
+			n = length;
+
+		row = terminal_get_row(terminal, terminal->row);
+		attr_row = terminal_get_attr_row(terminal, terminal->row);
+		for (i = 0; i < n; i++) {
+			row[terminal->column + i].ch = 0;
+			row[terminal->column + i].byte[0] = data[i];
+		}
+		attr_init(&attr_row[terminal->column], terminal->curr_attr, n);
+		terminal_dirty_cells(terminal, terminal->row, terminal->column,
+				     terminal->column + n);
+
+		terminal->column += n;
+		terminal_extend_log(terminal);
+
+		data += n;
+		length -= n;
 	}
 }
 
@@ -2038,10 +2999,21 @@ static void
 terminal_data(struct terminal *terminal, const char *data, size_t length)
 {
 	unsigned int i;
+	size_t run;
 	union utf8_char utf8;
 	enum utf8_state parser_state;
 
 	for (i = 0; i < length; i++) {
+		if (terminal_ascii_fast_path(terminal)) {
+			run = ascii_run_length(data + i, length - i);
+			if (run > 0) {
+				terminal_put_ascii(terminal, data + i, run);
+				i += run;
+				if (i == length)
+					break;
+			}
+		}
+
 		parser_state =
 			utf8_next_char(&terminal->state_machine, data[i]);
 		switch(parser_state) {
@@ -2181,7 +3153,8 @@ terminal_data(struct terminal *terminal, const char *data, size_t length)
 		} /* if */
 	} /* for */
 
-	window_schedule_redraw(terminal->window);
+	if (terminal->window && !(terminal->mode & MODE_SYNCHRONIZED))
+		window_schedule_redraw(terminal->window);
 }
 
 static void
@@ -2314,6 +3287,222 @@ terminal_new_instance(struct terminal *terminal)
 		terminal_destroy(new_terminal);
 }
 
+/* The cells of the line with the given absolute number */
+static union utf8_char *
+terminal_get_line(struct terminal *terminal, uint32_t line)
+{
+	int index;
+
+	if (history_has_line(&terminal->history, line)) {
+		history_decode(&terminal->history, line,
+			       terminal->search_data, terminal->search_attr,
+			       terminal->max_width,
+			       terminal->color_scheme->default_attr);
+		return terminal->search_data;
+	}
+
+	index = line & (terminal->buffer_height - 1);
+
+	return (void *) terminal->data + index * terminal->data_pitch;
+}
+
+/* Look for the query in a line, returning the first and the column
+ * after the last cell of the match, or -1 */
+static int
+terminal_search_line(struct terminal *terminal, uint32_t line, int *end)
+{
+	union utf8_char *data = terminal_get_line(terminal, line);
+	char *text = terminal->search_text;
+	int *columns = terminal->search_columns;
+	int col, i, len, n = 0;
+	char *match;
+
+	for (col = 0; col < terminal->width; col++) {
+		if (data[col].ch == 0x200B) /* space glyph */
+			continue;
+		len = data[col].ch ? utf8_length(data[col].byte[0]) : 1;
+		for (i = 0; i < len; i++) {
+			text[n] = data[col].ch ? data[col].byte[i] : ' ';
+			columns[n++] = col;
+		}
+	}
+
+	match = memmem(text, n, terminal->search_query,
+		       terminal->search_length);
+	if (!match)
+		return -1;
+
+	i = match - text;
+	*end = columns[i + terminal->search_length - 1] + 1;
+	if (is_wide(data[*end - 1]))
+		(*end)++;
+
+	return columns[i];
+}
+
+/* Whether the block of history holding the line may contain the
+ * query, going by its trigram bitmap. Sets *first to the line
+ * starting the block. */
+static int
+terminal_search_block(struct terminal *terminal, uint32_t line,
+		      uint32_t *first)
+{
+	struct terminal_history *history = &terminal->history;
+	struct history_block *block;
+	uint32_t index, oldest;
+	int i, hash;
+
+	oldest = history->end - history->count;
+	index = (line - oldest) / HISTORY_BLOCK_LINES;
+	block = history->blocks[index];
+	*first = oldest + index * HISTORY_BLOCK_LINES;
+
+	for (i = 0; i + 3 <= terminal->search_length; i++) {
+		hash = trigram_hash((unsigned char *)
+				    terminal->search_query + i);
+		if (!(block->trigrams[hash / 32] & (1u << (hash % 32))))
+			return 0;
+	}
+
+	return 1;
+}
+
+/* Bring the line into view and select the match with the selection */
+static void
+terminal_show_match(struct terminal *terminal, uint32_t line,
+		    int start_col, int end_col)
+{
+	uint32_t live_start, log_start, start;
+	int d;
+
+	live_start = terminal->scrolling ?
+		terminal->saved_start : terminal->start;
+	log_start = terminal_log_start(terminal);
+
+	start = line - terminal->height / 2;
+	if ((int32_t) (start - log_start) < 0)
+		start = log_start;
+	if ((int32_t) (start - live_start) > 0)
+		start = live_start;
+
+	terminal_dirty_selection(terminal);
+
+	d = start - terminal->start;
+	if (d) {
+		if (!terminal->scrolling)
+			terminal->saved_start = terminal->start;
+		terminal->scrolling = 1;
+		terminal->start = start;
+		terminal->row -= d;
+		terminal_dirty_scroll(terminal, d);
+	}
+
+	terminal->selection_start_row = line - start;
+	terminal->selection_start_col = start_col;
+	terminal->selection_end_row = line - start;
+	terminal->selection_end_col = end_col;
+	terminal_dirty_selection(terminal);
+
+	widget_schedule_redraw(terminal->widget);
+}
+
+/* Find the query in the lines before search_line, newest first. The
+ * ring is scanned, the history only in blocks passing the trigram
+ * test. */
+static void
+terminal_search(struct terminal *terminal)
+{
+	uint32_t line, first, log_start;
+	int start_col, end_col;
+
+	terminal->search_failed = 0;
+	if (terminal->search_length == 0) {
+		update_title(terminal);
+		return;
+	}
+
+	if (terminal->search_width != terminal->max_width) {
+		terminal->search_width = terminal->max_width;
+		terminal->search_data = xrealloc(terminal->search_data,
+						 terminal->data_pitch);
+		terminal->search_attr = xrealloc(terminal->search_attr,
+						 terminal->attr_pitch);
+		terminal->search_text =
+			xrealloc(terminal->search_text,
+				 terminal->max_width * SEARCH_CELL_BYTES);
+		terminal->search_columns =
+			xrealloc(terminal->search_columns,
+				 terminal->max_width * SEARCH_CELL_BYTES *
+				 sizeof terminal->search_columns[0]);
+	}
+
+	log_start = terminal_log_start(terminal);
+	line = terminal->search_line;
+	while ((int32_t) (line - log_start) > 0) {
+		line--;
+
+		if (history_has_line(&terminal->history, line) &&
+		    !terminal_search_block(terminal, line, &first)) {
+			line = first;
+			continue;
+		}
+
+		start_col = terminal_search_line(terminal, line, &end_col);
+		if (start_col >= 0) {
+			terminal->search_line = line;
+			terminal_show_match(terminal, line,
+					    start_col, end_col);
+			update_title(terminal);
+			return;
+		}
+	}
+
+	terminal->search_failed = 1;
+	update_title(terminal);
+}
+
+/* While searching, typing edits the query, which is looked for from
+ * the newest line again; Return moves on to older matches and Escape
+ * ends the search, leaving the last match selected. */
+static int
+handle_search_key(struct terminal *terminal, uint32_t sym)
+{
+	char buffer[8];
+	int len;
+
+	switch (sym) {
+	case XKB_KEY_Escape:
+		terminal->searching = 0;
+		update_title(terminal);
+		return 1;
+	case XKB_KEY_Return:
+	case XKB_KEY_KP_Enter:
+		terminal_search(terminal);
+		return 1;
+	case XKB_KEY_BackSpace:
+		while (terminal->search_length > 0 &&
+		       (terminal->search_query[--terminal->search_length] &
+			0xc0) == 0x80)
+			;
+		break;
+	default:
+		len = xkb_keysym_to_utf8(sym, buffer, sizeof buffer) - 1;
+		if (len <= 0 || (unsigned char) buffer[0] < 0x20 ||
+		    terminal->search_length + len > MAX_SEARCH)
+			return 1;
+		memcpy(terminal->search_query + terminal->search_length,
+		       buffer, len);
+		terminal->search_length += len;
+		break;
+	}
+
+	terminal->search_query[terminal->search_length] = '\0';
+	terminal->search_line = terminal->end;
+	terminal_search(terminal);
+
+	return 1;
+}
+
 static int
 handle_bound_key(struct terminal *terminal,
 		 struct input *input, uint32_t sym, uint32_t time)
@@ -2331,11 +3520,24 @@ handle_bound_key(struct terminal *terminal,
 	case XKB_KEY_N:
 		terminal_new_instance(terminal);
 		return 1;
+	case XKB_KEY_F:
+		/* start searching, or look for the next older match */
+		if (terminal->searching) {
+			terminal_search(terminal);
+		} else {
+			terminal->searching = 1;
+			terminal->search_length = 0;
+			terminal->search_query[0] = '\0';
+			terminal->search_line = terminal->end;
+			terminal->search_failed = 0;
+			update_title(terminal);
+		}
+		return 1;
 
 	case XKB_KEY_Up:
 		if (!terminal->scrolling)
 			terminal->saved_start = terminal->start;
-		if (terminal->start == terminal->end - terminal->log_size)
+		if (terminal->start == terminal_log_start(terminal))
 			return 1;
 
 		terminal->scrolling = 1;
@@ -2343,6 +3545,7 @@ handle_bound_key(struct terminal *terminal,
 		terminal->row++;
 		terminal->selection_start_row++;
 		terminal->selection_end_row++;
+		terminal_dirty_scroll(terminal, -1);
 		widget_schedule_redraw(terminal->widget);
 		return 1;
 
@@ -2358,6 +3561,7 @@ handle_bound_key(struct terminal *terminal,
 		terminal->row--;
 		terminal->selection_start_row--;
 		terminal->selection_end_row--;
+		terminal_dirty_scroll(terminal, 1);
 		widget_schedule_redraw(terminal->widget);
 		return 1;
 
@@ -2384,6 +3588,12 @@ key_handler(struct window *window, struct input *input, uint32_t time,
 	    handle_bound_key(terminal, input, sym, time))
 		return;
 
+	if (terminal->searching) {
+		if (state == WL_KEYBOARD_KEY_STATE_PRESSED)
+			handle_search_key(terminal, sym);
+		return;
+	}
+
 	/* Map keypad symbols to 'normal' equivalents before processing */
 	switch (sym) {
 	case XKB_KEY_KP_Space:
@@ -2585,6 +3795,7 @@ key_handler(struct window *window, struct input *input, uint32_t time,
 			terminal->selection_end_row -= d;
 			terminal->start = terminal->saved_start;
 			terminal->scrolling = 0;
+			terminal_dirty_scroll(terminal, d);
 			widget_schedule_redraw(terminal->widget);
 		}
 
@@ -2639,6 +3850,8 @@ recompute_selection(struct terminal *terminal)
 	side_margin = allocation.x + (allocation.width - width) / 2;
 	top_margin = allocation.y + (allocation.height - height) / 2;
 
+	terminal_dirty_selection(terminal);
+
 	start_row = (terminal->selection_start_y - top_margin + ch) / ch - 1;
 	end_row = (terminal->selection_end_y - top_margin + ch) / ch - 1;
 
@@ -2713,6 +3926,8 @@ recompute_selection(struct terminal *terminal)
 			terminal->selection_start_col = eol;
 	}
 
+	terminal_dirty_selection(terminal);
+
 	return 1;
 }
 
@@ -2862,8 +4077,8 @@ axis_handler(struct widget *widget,
 	} else if (lines < 0) {
 		uint32_t neg_lines = -lines;
 
-		if (neg_lines > terminal->log_size + terminal->start - terminal->end)
-			lines = terminal->end - terminal->log_size - terminal->start;
+		if (neg_lines > terminal->start - terminal_log_start(terminal))
+			lines = terminal_log_start(terminal) - terminal->start;
 	}
 
 	if (lines) {
@@ -2876,6 +4091,7 @@ axis_handler(struct widget *widget,
 		terminal->selection_start_row -= lines;
 		terminal->selection_end_row -= lines;
 
+		terminal_dirty_scroll(terminal, lines);
 		widget_schedule_redraw(widget);
 	}
 }
@@ -2931,8 +4147,9 @@ touch_motion_handler(struct widget *widget, struct input *input,
 #define howmany(x, y) (((x) + ((y) - 1)) / (y))
 #endif
 
+/* The parts of a terminal that don't need a window */
 static struct terminal *
-terminal_create(struct display *display)
+terminal_alloc(void)
 {
 	struct terminal *terminal;
 	cairo_surface_t *surface;
@@ -2944,42 +4161,16 @@ terminal_create(struct display *display)
 	terminal_init(terminal);
 	terminal->margin_top = 0;
 	terminal->margin_bottom = -1;
-	terminal->window = window_create(display);
-	terminal->widget = window_frame_create(terminal->window, terminal);
 	terminal->title = xstrdup("Wayland Terminal");
-	window_set_title(terminal->window, terminal->title);
-	widget_set_transparent(terminal->widget, 0);
 
 	init_state_machine(&terminal->state_machine);
 	init_color_table(terminal);
 
-	terminal->display = display;
 	terminal->margin = 5;
 	terminal->buffer_height = 1024;
+	terminal->pty_buffer = xmalloc(PTY_BUFFER_SIZE);
 	terminal->end = 1;
 
-	window_set_user_data(terminal->window, terminal);
-	window_set_key_handler(terminal->window, key_handler);
-	window_set_keyboard_focus_handler(terminal->window,
-					  keyboard_focus_handler);
-	window_set_fullscreen_handler(terminal->window, fullscreen_handler);
-	window_set_output_handler(terminal->window, output_handler);
-	window_set_close_handler(terminal->window, close_handler);
-	window_set_state_changed_handler(terminal->window, state_changed_handler);
-
-	window_set_data_handler(terminal->window, data_handler);
-	window_set_drop_handler(terminal->window, drop_handler);
-
-	widget_set_redraw_handler(terminal->widget, redraw_handler);
-	widget_set_resize_handler(terminal->widget, resize_handler);
-	widget_set_button_handler(terminal->widget, button_handler);
-	widget_set_enter_handler(terminal->widget, enter_handler);
-	widget_set_motion_handler(terminal->widget, motion_handler);
-	widget_set_axis_handler(terminal->widget, axis_handler);
-	widget_set_touch_up_handler(terminal->widget, touch_up_handler);
-	widget_set_touch_down_handler(terminal->widget, touch_down_handler);
-	widget_set_touch_motion_handler(terminal->widget, touch_motion_handler);
-
 	surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, 0, 0);
 	cr = cairo_create(surface);
 	cairo_set_font_size(cr, option_font_size);
@@ -2995,7 +4186,12 @@ terminal_create(struct display *display)
 	terminal->font_normal = cairo_get_scaled_font (cr);
 	cairo_scaled_font_reference(terminal->font_normal);
 
+	terminal->glyph_cache = xzalloc(GLYPH_CACHE_SIZE *
+					sizeof terminal->glyph_cache[0]);
+
 	cairo_font_extents(cr, &terminal->extents);
+	/* Whole pixel rows, so that scrolling can move drawn lines */
+	terminal->extents.height = ceil(terminal->extents.height);
 
 	/* Compute the average ascii glyph width */
 	cairo_text_extents(cr, TERMINAL_DRAW_SINGLE_WIDE_CHARACTERS,
@@ -3008,6 +4204,75 @@ terminal_create(struct display *display)
 	cairo_destroy(cr);
 	cairo_surface_destroy(surface);
 
+	return terminal;
+}
+
+static void
+terminal_free(struct terminal *terminal)
+{
+	free(terminal->title);
+	free(terminal->dirty);
+	free(terminal->decoded);
+	free(terminal->decoded_valid);
+	free(terminal->glyph_cache);
+	free(terminal->pty_buffer);
+	history_release(&terminal->history);
+	free(terminal->search_data);
+	free(terminal->search_attr);
+	free(terminal->search_text);
+	free(terminal->search_columns);
+	free(terminal->data);
+	free(terminal->data_attr);
+	free(terminal->tab_ruler);
+	cairo_scaled_font_destroy(terminal->font_normal);
+	cairo_scaled_font_destroy(terminal->font_bold);
+	free(terminal);
+}
+
+static struct terminal *
+terminal_create(struct display *display)
+{
+	struct terminal *terminal;
+
+	terminal = terminal_alloc();
+	terminal->window = window_create(display);
+	terminal->widget = window_frame_create(terminal->window, terminal);
+	window_set_title(terminal->window, terminal->title);
+	window_set_redraw_margin(terminal->window, REDRAW_MARGIN_USEC);
+	widget_set_transparent(terminal->widget, 0);
+
+	terminal->display = display;
+	toytimer_init(&terminal->parse_timer, CLOCK_MONOTONIC, display,
+		      parse_timer_func);
+	terminal->parse_timer.tsk.priority = TASK_PRIORITY_LOW;
+	toytimer_init(&terminal->sync_timer, CLOCK_MONOTONIC, display,
+		      sync_timer_func);
+
+	window_set_user_data(terminal->window, terminal);
+	window_set_key_handler(terminal->window, key_handler);
+	window_set_keyboard_focus_handler(terminal->window,
+					  keyboard_focus_handler);
+	window_set_fullscreen_handler(terminal->window, fullscreen_handler);
+	window_set_output_handler(terminal->window, output_handler);
+	window_set_close_handler(terminal->window, close_handler);
+	window_set_state_changed_handler(terminal->window, state_changed_handler);
+
+	window_set_data_handler(terminal->window, data_handler);
+	window_set_drop_handler(terminal->window, drop_handler);
+
+	widget_set_redraw_handler(terminal->widget, redraw_handler);
+	widget_set_prepare_redraw_handler(terminal->widget,
+					  prepare_redraw_handler);
+	widget_set_resize_handler(terminal->widget, resize_handler);
+	widget_set_damage_tracking(terminal->widget, 1);
+	widget_set_button_handler(terminal->widget, button_handler);
+	widget_set_enter_handler(terminal->widget, enter_handler);
+	widget_set_motion_handler(terminal->widget, motion_handler);
+	widget_set_axis_handler(terminal->widget, axis_handler);
+	widget_set_touch_up_handler(terminal->widget, touch_up_handler);
+	widget_set_touch_down_handler(terminal->widget, touch_down_handler);
+	widget_set_touch_motion_handler(terminal->widget, touch_motion_handler);
+
 	terminal_resize(terminal, 20, 5); /* Set minimum size first */
 	terminal_resize(terminal, 80, 25);
 
@@ -3020,6 +4285,8 @@ static void
 terminal_destroy(struct terminal *terminal)
 {
 	display_unwatch_fd(terminal->display, terminal->master);
+	toytimer_fini(&terminal->parse_timer);
+	toytimer_fini(&terminal->sync_timer);
 	window_destroy(terminal->window);
 	close(terminal->master);
 	wl_list_remove(&terminal->link);
@@ -3027,8 +4294,76 @@ terminal_destroy(struct terminal *terminal)
 	if (wl_list_empty(&terminal_list))
 		display_exit(terminal->display);
 
-	free(terminal->title);
-	free(terminal);
+	terminal_free(terminal);
+}
+
+/* Parse buffered output until it is used up or the time budget is
+ * spent; the rest is parsed after the events that came in meanwhile.
+ * Redraws are only scheduled, so all of it is drawn in one frame. */
+static void
+terminal_parse_output(struct terminal *terminal)
+{
+	struct timespec start, now;
+	uint32_t offset, length;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (terminal->pty_head != terminal->pty_tail) {
+		offset = terminal->pty_head & (PTY_BUFFER_SIZE - 1);
+		length = MIN(terminal->pty_tail - terminal->pty_head,
+			     PTY_BUFFER_SIZE - offset);
+		length = MIN(length, PTY_PARSE_CHUNK);
+		terminal_data(terminal, terminal->pty_buffer + offset, length);
+		terminal->pty_head += length;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (timespec_sub_to_nsec(&now, &start) > PTY_PARSE_BUDGET_NSEC)
+			break;
+	}
+
+	if (terminal->pty_head != terminal->pty_tail)
+		toytimer_arm_once_usec(&terminal->parse_timer, 1);
+}
+
+static void
+parse_timer_func(struct toytimer *tt)
+{
+	struct terminal *terminal =
+		container_of(tt, struct terminal, parse_timer);
+
+	terminal_parse_output(terminal);
+}
+
+static void
+sync_timer_func(struct toytimer *tt)
+{
+	struct terminal *terminal =
+		container_of(tt, struct terminal, sync_timer);
+
+	terminal_synchronize(terminal, 0);
+}
+
+/* Read as much output as the buffer takes. Returns -1 on errors. */
+static int
+terminal_read_output(struct terminal *terminal)
+{
+	uint32_t used, offset;
+	ssize_t len;
+
+	while ((used = terminal->pty_tail - terminal->pty_head) <
+	       PTY_BUFFER_SIZE) {
+		offset = terminal->pty_tail & (PTY_BUFFER_SIZE - 1);
+		len = read(terminal->master, terminal->pty_buffer + offset,
+			   MIN(PTY_BUFFER_SIZE - used,
+			       PTY_BUFFER_SIZE - offset));
+		if (len > 0)
+			terminal->pty_tail += len;
+		else if (len == 0 || errno == EAGAIN)
+			break;
+		else if (errno != EINTR)
+			return -1;
+	}
+
+	return 0;
 }
 
 static void
@@ -3036,19 +4371,18 @@ io_handler(struct task *task, uint32_t events)
 {
 	struct terminal *terminal =
 		container_of(task, struct terminal, io_task);
-	char buffer[256];
-	int len;
 
 	if (events & EPOLLHUP) {
 		terminal_destroy(terminal);
 		return;
 	}
 
-	len = read(terminal->master, buffer, sizeof buffer);
-	if (len < 0)
+	if (terminal_read_output(terminal) < 0) {
 		terminal_destroy(terminal);
-	else
-		terminal_data(terminal, buffer, len);
+		return;
+	}
+
+	terminal_parse_output(terminal);
 }
 
 static int
@@ -3101,6 +4435,7 @@ terminal_run(struct terminal *terminal, const char *path)
 	terminal->pace_pipe = pipes[1];
 	fcntl(master, F_SETFL, O_NONBLOCK);
 	terminal->io_task.run = io_handler;
+	terminal->io_task.priority = TASK_PRIORITY_LOW;
 	display_watch_fd(terminal->display, terminal->master,
 			 EPOLLIN | EPOLLHUP, &terminal->io_task);
 
@@ -3114,12 +4449,119 @@ terminal_run(struct terminal *terminal, const char *path)
 	return 0;
 }
 
+/* Read all of a file, or stdin for "-" */
+static char *
+read_file(const char *path, size_t *length)
+{
+	FILE *fp;
+	char *data = NULL;
+	size_t size = 0, n;
+
+	fp = strcmp(path, "-") ? fopen(path, "rb") : stdin;
+	if (!fp)
+		return NULL;
+
+	*length = 0;
+	do {
+		if (*length == size) {
+			size = size ? 2 * size : PTY_BUFFER_SIZE;
+			data = xrealloc(data, size);
+		}
+		n = fread(data + *length, 1, size - *length, fp);
+		*length += n;
+	} while (n > 0);
+
+	if (fp != stdin)
+		fclose(fp);
+
+	return data;
+}
+
+/* Feed a recorded byte stream through the parser and render a frame
+ * into an image surface for every BENCHMARK_FRAME_BYTES of it, with
+ * no compositor involved. Every frame redraws all of the cells, and
+ * the times for parsing and drawing are reported separately. */
+static int
+terminal_benchmark(const char *path)
+{
+	struct terminal *terminal;
+	struct rectangle allocation;
+	struct timespec t0, t1;
+	cairo_surface_t *surface;
+	cairo_t *cr;
+	char *data;
+	size_t length, offset, n, next_frame;
+	int64_t parse_nsec = 0, draw_nsec = 0;
+	int frames = 0;
+
+	data = read_file(path, &length);
+	if (!data) {
+		fprintf(stderr, "failed to read %s: %s\n",
+			path, strerror(errno));
+		return -1;
+	}
+
+	terminal = terminal_alloc();
+	terminal->master = open("/dev/null", O_WRONLY | O_CLOEXEC);
+	terminal->pace_pipe = -1;
+	terminal_resize_cells(terminal, 80, 24);
+
+	allocation.x = 0;
+	allocation.y = 0;
+	allocation.width = terminal->width * terminal->average_width +
+		2 * terminal->margin;
+	allocation.height = terminal->height * terminal->extents.height +
+		2 * terminal->margin;
+	surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+					     allocation.width,
+					     allocation.height);
+	cr = cairo_create(surface);
+
+	next_frame = BENCHMARK_FRAME_BYTES;
+	for (offset = 0; offset < length; offset += n) {
+		n = MIN(length - offset, PTY_PARSE_CHUNK);
+
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		terminal_data(terminal, data + offset, n);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		parse_nsec += timespec_sub_to_nsec(&t1, &t0);
+
+		if (offset + n < next_frame && offset + n < length)
+			continue;
+		next_frame += BENCHMARK_FRAME_BYTES;
+
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		terminal_draw(terminal, cr, &allocation);
+		cairo_surface_flush(surface);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		draw_nsec += timespec_sub_to_nsec(&t1, &t0);
+		frames++;
+	}
+
+	printf("parsed %zu bytes in %.1f ms: %.1f MB/s\n",
+	       length, parse_nsec / 1e6,
+	       parse_nsec ? length * 1e3 / parse_nsec : 0.0);
+	printf("rendered %d frames of %dx%d cells in %.1f ms: "
+	       "%.2f ms per frame\n",
+	       frames, terminal->width, terminal->height, draw_nsec / 1e6,
+	       frames ? draw_nsec / 1e6 / frames : 0.0);
+
+	cairo_destroy(cr);
+	cairo_surface_destroy(surface);
+	close(terminal->master);
+	terminal_free(terminal);
+	free(data);
+
+	return 0;
+}
+
 static const struct weston_option terminal_options[] = {
 	{ WESTON_OPTION_BOOLEAN, "fullscreen", 'f', &option_fullscreen },
 	{ WESTON_OPTION_BOOLEAN, "maximized", 'm', &option_maximize },
 	{ WESTON_OPTION_STRING, "font", 0, &option_font },
 	{ WESTON_OPTION_INTEGER, "font-size", 0, &option_font_size },
 	{ WESTON_OPTION_STRING, "shell", 0, &option_shell },
+	{ WESTON_OPTION_STRING, "benchmark", 0, &option_benchmark },
 };
 
 int main(int argc, char *argv[])
@@ -3153,10 +4595,14 @@ int main(int argc, char *argv[])
 		       "  --maximized or -m\n"
 		       "  --font=NAME\n"
 		       "  --font-size=SIZE\n"
-		       "  --shell=NAME\n", argv[0]);
+		       "  --shell=NAME\n"
+		       "  --benchmark=FILE\n", argv[0]);
 		return 1;
 	}
 
+	if (option_benchmark)
+		return terminal_benchmark(option_benchmark) ? 1 : 0;
+
 	d = display_create(&argc, argv);
 	if (d == NULL) {
 		fprintf(stderr, "failed to create display: %s\n",
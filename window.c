@@ -40,6 +40,9 @@
 #include <sys/mman.h>
 #include <sys/epoll.h>
 #include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <signal.h>
+#include <pthread.h>
 #include <stdbool.h>
 
 #ifdef HAVE_CAIRO_EGL
@@ -78,8 +81,10 @@ typedef void *EGLContext;
 #include "text-cursor-position-client-protocol.h"
 #include "pointer-constraints-unstable-v1-client-protocol.h"
 #include "relative-pointer-unstable-v1-client-protocol.h"
+#include "presentation-time-client-protocol.h"
 #include "shared/os-compatibility.h"
 #include "shared/string-helpers.h"
+#include "shared/timespec-util.h"
 
 #include "window.h"
 
@@ -97,6 +102,20 @@ struct global {
 	struct wl_list link;
 };
 
+struct render_batch {
+	int pending;
+};
+
+/* A unit of work for the display render threads */
+struct render_job {
+	void (*run)(struct render_job *job);
+	struct render_batch *batch;
+	struct wl_list link;
+};
+
+#define MIN_EPOLL_EVENTS 32
+#define MAX_EPOLL_EVENTS 512
+
 struct display {
 	struct wl_display *display;
 	struct wl_registry *registry;
@@ -108,6 +127,8 @@ struct display {
 	struct xdg_wm_base *xdg_shell;
 	struct zwp_relative_pointer_manager_v1 *relative_pointer_manager;
 	struct zwp_pointer_constraints_v1 *pointer_constraints;
+	struct wp_presentation *presentation;
+	clockid_t presentation_clock;
 	EGLDisplay dpy;
 	EGLConfig argb_config;
 	EGLContext argb_ctx;
@@ -119,6 +140,8 @@ struct display {
 	struct task display_task;
 
 	int epoll_fd;
+	struct epoll_event *epoll_events;
+	int epoll_events_size;
 	struct wl_list deferred_list;
 
 	int running;
@@ -147,6 +170,25 @@ struct display {
 
 	int has_rgb565;
 	int data_device_manager_version;
+
+	/* TOYTOOLKIT_TRACE: trace all windows, write them here on SIGUSR1 */
+	char *trace_path;
+	int trace_signal_fd;
+	struct task trace_task;
+	int trace_next_id;
+
+	struct render_pool *render_pool;
+
+	struct shm_arena *shm_arena;
+
+	/* Idle resize pools, kept for the next interactive resize of any
+	 * window, and the size new ones are created with. */
+	struct wl_list resize_pools;
+	size_t resize_pool_size;
+
+	/* Number of times a redraw was deferred because the server held
+	 * all buffers of a surface. */
+	uint32_t buffer_starvation_count;
 };
 
 struct window_output {
@@ -172,11 +214,28 @@ struct toysurface {
 	 * Post the surface to the server, returning the server allocation
 	 * rectangle. The Cairo surface from prepare() must be destroyed
 	 * after calling this.
+	 * damage is the changed area in buffer coordinates, or NULL if
+	 * the whole buffer must be considered damaged.
 	 */
 	void (*swap)(struct toysurface *base,
 		     enum wl_output_transform buffer_transform, int32_t buffer_scale,
+		     cairo_region_t *damage,
 		     struct rectangle *server_allocation);
 
+	/*
+	 * Return the age of the buffer handed out by the last prepare():
+	 * 1 if it still holds the previously posted frame, 0 if its
+	 * contents are undefined.
+	 */
+	int (*get_buffer_age)(struct toysurface *base);
+
+	/*
+	 * Limit the number of buffers the toysurface may cycle through.
+	 * Implementations clamp count to what they support, or ignore
+	 * it when the buffers are not under their control.
+	 */
+	void (*set_max_buffers)(struct toysurface *base, int count);
+
 	/*
 	 * Make the toysurface current with the given EGL context.
 	 * Returns 0 on success, and negative on failure.
@@ -215,6 +274,31 @@ struct surface {
 	struct wl_region *input_region;
 	struct wl_region *opaque_region;
 
+	/* Damage reported by widgets since the last swap, in the same
+	 * coordinates as widget allocations. damage_all is set when some
+	 * widget redrew without reporting its damage. */
+	cairo_region_t *damage;
+	int damage_all;
+
+	/* Moved by widget_scroll_region(): up to date in the buffer, so
+	 * only sent to the compositor and never clipped to. */
+	cairo_region_t *scrolled;
+
+	/* Set during a redraw into a buffer that holds the previous frame
+	 * while every widget tracks damage; widget_cairo_create() then
+	 * clips to the damage. clip_stale records damage reported after
+	 * such a clip was already in use. */
+	int partial;
+	int clip_used;
+	int clip_stale;
+
+	/* Buffer count limit for the toysurface, 0 for the default */
+	int max_buffers;
+
+	/* Drawn by the display render pool during idle_redraw() */
+	struct render_job render_job;
+	int threaded;
+
 	enum window_buffer_type buffer_type;
 	enum wl_output_transform buffer_transform;
 	int32_t buffer_scale;
@@ -236,6 +320,14 @@ struct window {
 	int redraw_inhibited;
 	int redraw_needed;
 	int redraw_task_scheduled;
+
+	/* Frame pacing, see window_set_redraw_margin() */
+	int32_t redraw_margin_usec;
+	int redraw_timer_initialized;
+	struct toytimer redraw_timer;
+	struct wp_presentation_feedback *presentation_feedback;
+	struct timespec last_presentation;
+	uint32_t refresh_nsec;
 	struct task redraw_task;
 	int resize_needed;
 	int custom;
@@ -284,6 +376,8 @@ struct window {
 	struct widget *confined_widget;
 	bool confined;
 
+	struct window_trace *trace;
+
 	void *user_data;
 	struct wl_list link;
 };
@@ -297,6 +391,7 @@ struct widget {
 	struct rectangle allocation;
 	widget_resize_handler_t resize_handler;
 	widget_redraw_handler_t redraw_handler;
+	widget_prepare_redraw_handler_t prepare_redraw_handler;
 	widget_enter_handler_t enter_handler;
 	widget_leave_handler_t leave_handler;
 	widget_motion_handler_t motion_handler;
@@ -320,6 +415,17 @@ struct widget {
 	 * redraw handler is going to do completely custom rendering
 	 * such as using EGL directly */
 	int use_cairo;
+	/* If this is set the redraw handler reports what it changed
+	 * with widget_damage_region(), otherwise every redraw of the
+	 * widget damages the whole surface. */
+	int damage_tracking;
+
+	/* The redraw handler only draws into its own surface and may run
+	 * on a render pool thread. */
+	int thread_safe;
+
+	/* The redraw handler may be called concurrently, once per tile */
+	int tiled;
 };
 
 struct touch_point {
@@ -400,6 +506,8 @@ struct output {
 	struct wl_list link;
 	int transform;
 	int scale;
+	/* the largest mode advertised, current or not */
+	int max_mode_width, max_mode_height;
 	char *make;
 	char *model;
 
@@ -444,6 +552,39 @@ struct shm_pool {
 	size_t size;
 	size_t used;
 	void *data;
+	struct wl_list link;
+};
+
+/* One growable pool per display that small shm buffers are
+ * sub-allocated from, so that a new tooltip, menu or subsurface buffer
+ * does not need a new file, mmap and wl_shm_pool on both sides of the
+ * connection. Buffers above SHM_ARENA_MAX_BUFFER, such as those of
+ * large windows, and any the arena can't fit get a pool of their own.
+ * Freed ranges are punched out of the file, so the arena only keeps
+ * the memory of live buffers. */
+#define SHM_ARENA_INITIAL_SIZE (1024 * 1024)
+#define SHM_ARENA_MAX_SIZE ((size_t) 64 * 1024 * 1024)
+#define SHM_ARENA_MAX_BUFFER (2 * 1024 * 1024)
+#define SHM_ARENA_ALIGN 4096
+
+struct shm_arena_block {
+	size_t offset;
+	size_t size;
+	struct wl_list link;
+};
+
+struct shm_arena {
+	/* destroyed with the display, see display_destroy() */
+	struct wl_shm_pool *pool;
+	int fd;
+	/* start of SHM_ARENA_MAX_SIZE bytes of reserved address space,
+	 * of which the first 'size' bytes are mapped */
+	char *data;
+	size_t size;
+	/* free blocks, sorted by offset, never adjacent */
+	struct wl_list free_list;
+	/* the display plus one per live allocation */
+	int users;
 };
 
 enum {
@@ -575,6 +716,7 @@ egl_window_surface_prepare(struct toysurface *base, int dx, int dy,
 static void
 egl_window_surface_swap(struct toysurface *base,
 			enum wl_output_transform buffer_transform, int32_t buffer_scale,
+			cairo_region_t *damage,
 			struct rectangle *server_allocation)
 {
 	struct egl_window_surface *surface = to_egl_window_surface(base);
@@ -589,6 +731,17 @@ egl_window_surface_swap(struct toysurface *base,
 				&server_allocation->height);
 }
 
+static int
+egl_window_surface_get_buffer_age(struct toysurface *base)
+{
+	return 0;
+}
+
+static void
+egl_window_surface_set_max_buffers(struct toysurface *base, int count)
+{
+}
+
 static int
 egl_window_surface_acquire(struct toysurface *base, EGLContext ctx)
 {
@@ -663,6 +816,8 @@ egl_window_surface_create(struct display *display,
 
 	surface->base.prepare = egl_window_surface_prepare;
 	surface->base.swap = egl_window_surface_swap;
+	surface->base.get_buffer_age = egl_window_surface_get_buffer_age;
+	surface->base.set_max_buffers = egl_window_surface_set_max_buffers;
 	surface->base.acquire = egl_window_surface_acquire;
 	surface->base.release = egl_window_surface_release;
 	surface->base.destroy = egl_window_surface_destroy;
@@ -704,6 +859,11 @@ egl_window_surface_create(struct display *display,
 struct shm_surface_data {
 	struct wl_buffer *buffer;
 	struct shm_pool *pool;
+
+	/* set when the buffer was allocated from the display arena */
+	struct shm_arena *arena;
+	int offset;
+	size_t length;
 };
 
 struct wl_buffer *
@@ -720,6 +880,9 @@ display_get_buffer_for_surface(struct display *display,
 static void
 shm_pool_destroy(struct shm_pool *pool);
 
+static void
+shm_arena_free(struct shm_arena *arena, size_t offset, size_t size);
+
 static void
 shm_surface_data_destroy(void *p)
 {
@@ -728,6 +891,8 @@ shm_surface_data_destroy(void *p)
 	wl_buffer_destroy(data->buffer);
 	if (data->pool)
 		shm_pool_destroy(data->pool);
+	if (data->arena)
+		shm_arena_free(data->arena, data->offset, data->length);
 
 	free(data);
 }
@@ -807,6 +972,207 @@ shm_pool_reset(struct shm_pool *pool)
 	pool->used = 0;
 }
 
+static size_t
+shm_arena_align(size_t size)
+{
+	return (size + SHM_ARENA_ALIGN - 1) & ~((size_t) SHM_ARENA_ALIGN - 1);
+}
+
+/* Return a range to the free list, merging it with its neighbours */
+static void
+shm_arena_add_free(struct shm_arena *arena, size_t offset, size_t size)
+{
+	struct shm_arena_block *block, *prev = NULL, *next = NULL;
+
+	wl_list_for_each(block, &arena->free_list, link) {
+		if (block->offset > offset) {
+			next = block;
+			break;
+		}
+		prev = block;
+	}
+
+	if (prev && prev->offset + prev->size == offset) {
+		prev->size += size;
+		if (next && prev->offset + prev->size == next->offset) {
+			prev->size += next->size;
+			wl_list_remove(&next->link);
+			free(next);
+		}
+		return;
+	}
+
+	if (next && offset + size == next->offset) {
+		next->offset = offset;
+		next->size += size;
+		return;
+	}
+
+	block = xzalloc(sizeof *block);
+	block->offset = offset;
+	block->size = size;
+	wl_list_insert(prev ? &prev->link : &arena->free_list, &block->link);
+}
+
+static struct shm_arena *
+shm_arena_create(struct display *display)
+{
+	struct shm_arena *arena;
+	void *map;
+
+	arena = zalloc(sizeof *arena);
+	if (!arena)
+		return NULL;
+
+	/* Reserve address space for the largest arena up front, so that
+	 * growing never moves memory that cairo surfaces point into. */
+	map = mmap(NULL, SHM_ARENA_MAX_SIZE, PROT_NONE,
+		   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "reserving shm arena failed: %s\n",
+			strerror(errno));
+		free(arena);
+		return NULL;
+	}
+	arena->data = map;
+
+	arena->fd = os_create_anonymous_file(SHM_ARENA_INITIAL_SIZE);
+	if (arena->fd < 0) {
+		fprintf(stderr, "creating a buffer file for %d B failed: %s\n",
+			SHM_ARENA_INITIAL_SIZE, strerror(errno));
+		goto err_unmap;
+	}
+
+	map = mmap(arena->data, SHM_ARENA_INITIAL_SIZE,
+		   PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+		   arena->fd, 0);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "mmap failed: %s\n", strerror(errno));
+		goto err_close;
+	}
+
+	arena->pool = wl_shm_create_pool(display->shm, arena->fd,
+					 SHM_ARENA_INITIAL_SIZE);
+	arena->size = SHM_ARENA_INITIAL_SIZE;
+	wl_list_init(&arena->free_list);
+	shm_arena_add_free(arena, 0, arena->size);
+	arena->users = 1;
+
+	return arena;
+
+err_close:
+	close(arena->fd);
+err_unmap:
+	munmap(arena->data, SHM_ARENA_MAX_SIZE);
+	free(arena);
+	return NULL;
+}
+
+static int
+shm_arena_grow(struct shm_arena *arena, size_t needed)
+{
+	size_t size = arena->size;
+	void *map;
+
+	while (size < arena->size + needed && size < SHM_ARENA_MAX_SIZE)
+		size *= 2;
+	if (size > SHM_ARENA_MAX_SIZE)
+		size = SHM_ARENA_MAX_SIZE;
+	if (size < arena->size + needed)
+		return -1;
+
+	if (ftruncate(arena->fd, size) < 0) {
+		fprintf(stderr, "growing shm arena to %zu B failed: %s\n",
+			size, strerror(errno));
+		return -1;
+	}
+
+	map = mmap(arena->data + arena->size, size - arena->size,
+		   PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+		   arena->fd, arena->size);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "mmap failed: %s\n", strerror(errno));
+		return -1;
+	}
+
+	wl_shm_pool_resize(arena->pool, size);
+	shm_arena_add_free(arena, arena->size, size - arena->size);
+	arena->size = size;
+
+	return 0;
+}
+
+static void *
+shm_arena_find(struct shm_arena *arena, size_t size, int *offset)
+{
+	struct shm_arena_block *block;
+
+	/* first fit */
+	wl_list_for_each(block, &arena->free_list, link) {
+		if (block->size < size)
+			continue;
+
+		*offset = block->offset;
+		block->offset += size;
+		block->size -= size;
+		if (block->size == 0) {
+			wl_list_remove(&block->link);
+			free(block);
+		}
+		arena->users++;
+
+		return arena->data + *offset;
+	}
+
+	return NULL;
+}
+
+static void *
+shm_arena_allocate(struct shm_arena *arena, size_t size, int *offset)
+{
+	void *map;
+
+	size = shm_arena_align(size);
+
+	map = shm_arena_find(arena, size, offset);
+	if (!map && shm_arena_grow(arena, size) == 0)
+		map = shm_arena_find(arena, size, offset);
+
+	return map;
+}
+
+static void
+shm_arena_unref(struct shm_arena *arena)
+{
+	struct shm_arena_block *block, *tmp;
+
+	if (--arena->users > 0)
+		return;
+
+	wl_list_for_each_safe(block, tmp, &arena->free_list, link)
+		free(block);
+
+	if (arena->pool)
+		wl_shm_pool_destroy(arena->pool);
+	close(arena->fd);
+	munmap(arena->data, SHM_ARENA_MAX_SIZE);
+	free(arena);
+}
+
+static void
+shm_arena_free(struct shm_arena *arena, size_t offset, size_t size)
+{
+	size = shm_arena_align(size);
+
+	/* Give the pages back; on failure they are just kept until the
+	 * range is reused */
+	fallocate(arena->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		  offset, size);
+
+	shm_arena_add_free(arena, offset, size);
+	shm_arena_unref(arena);
+}
+
 static int
 data_length_for_shm_surface(struct rectangle *rect)
 {
@@ -817,19 +1183,105 @@ data_length_for_shm_surface(struct rectangle *rect)
 	return stride * rect->height;
 }
 
+#define MAX_IDLE_RESIZE_POOLS 3
+#define DEFAULT_RESIZE_POOL_SIZE (6 * 1024 * 1024)
+
+#ifdef USE_RESIZE_POOL
+/* Enough for a buffer covering the largest mode of any output */
+static size_t
+display_get_output_pool_size(struct display *display)
+{
+	struct output *output;
+	struct rectangle rect;
+	size_t size = 0;
+
+	wl_list_for_each(output, &display->output_list, link) {
+		rect.width = output->max_mode_width;
+		rect.height = output->max_mode_height;
+		if ((size_t) data_length_for_shm_surface(&rect) > size)
+			size = data_length_for_shm_surface(&rect);
+	}
+
+	return size ? size : DEFAULT_RESIZE_POOL_SIZE;
+}
+
+static struct shm_pool *
+display_get_resize_pool(struct display *display, size_t length)
+{
+	struct shm_pool *pool, *tmp;
+	size_t size;
+
+	size = display_get_output_pool_size(display);
+	if (size < display->resize_pool_size)
+		size = display->resize_pool_size;
+	while (size < length)
+		size *= 2;
+	display->resize_pool_size = size;
+
+	wl_list_for_each_safe(pool, tmp, &display->resize_pools, link) {
+		wl_list_remove(&pool->link);
+		if (pool->size >= length)
+			return pool;
+
+		shm_pool_destroy(pool);
+	}
+
+	return shm_pool_create(display, size);
+}
+#endif
+
+static int
+display_is_resizing(struct display *display)
+{
+	struct window *window;
+
+	wl_list_for_each(window, &display->window_list, link)
+		if (window->resizing)
+			return 1;
+
+	return 0;
+}
+
+/* Keep the pool for the next resize while some window is being
+ * resized; once none is, idle pools are released altogether. */
+static void
+display_put_resize_pool(struct display *display, struct shm_pool *pool)
+{
+	struct shm_pool *tmp;
+
+	if (!display_is_resizing(display)) {
+		shm_pool_destroy(pool);
+		wl_list_for_each_safe(pool, tmp, &display->resize_pools, link) {
+			wl_list_remove(&pool->link);
+			shm_pool_destroy(pool);
+		}
+		return;
+	}
+
+	if (pool->size < display->resize_pool_size ||
+	    wl_list_length(&display->resize_pools) >= MAX_IDLE_RESIZE_POOLS) {
+		shm_pool_destroy(pool);
+		return;
+	}
+
+	wl_list_insert(&display->resize_pools, &pool->link);
+}
+
+/* Allocate from pool, or from the display arena if pool is NULL */
 static cairo_surface_t *
 display_create_shm_surface_from_pool(struct display *display,
 				     struct rectangle *rectangle,
 				     uint32_t flags, struct shm_pool *pool)
 {
 	struct shm_surface_data *data;
+	struct wl_shm_pool *wl_pool;
 	uint32_t format;
 	cairo_surface_t *surface;
 	cairo_format_t cairo_format;
 	int stride, length, offset;
 	void *map;
 
-	data = malloc(sizeof *data);
+	data = zalloc(sizeof *data);
 	if (data == NULL)
 		return NULL;
 
@@ -840,8 +1292,16 @@ display_create_shm_surface_from_pool(struct display *display,
 
 	stride = cairo_format_stride_for_width (cairo_format, rectangle->width);
 	length = stride * rectangle->height;
-	data->pool = NULL;
-	map = shm_pool_allocate(pool, length, &offset);
+	if (pool) {
+		map = shm_pool_allocate(pool, length, &offset);
+		wl_pool = pool->pool;
+	} else {
+		map = shm_arena_allocate(display->shm_arena, length, &offset);
+		wl_pool = display->shm_arena->pool;
+		data->arena = display->shm_arena;
+		data->offset = offset;
+		data->length = length;
+	}
 
 	if (!map) {
 		free(data);
@@ -866,7 +1326,7 @@ display_create_shm_surface_from_pool(struct display *display,
 			format = WL_SHM_FORMAT_ARGB8888;
 	}
 
-	data->buffer = wl_shm_pool_create_buffer(pool->pool, offset,
+	data->buffer = wl_shm_pool_create_buffer(wl_pool, offset,
 						 rectangle->width,
 						 rectangle->height,
 						 stride, format);
@@ -897,6 +1357,18 @@ display_create_shm_surface(struct display *display,
 		}
 	}
 
+	if (display->shm_arena &&
+	    data_length_for_shm_surface(rectangle) <= SHM_ARENA_MAX_BUFFER) {
+		surface = display_create_shm_surface_from_pool(display,
+							       rectangle,
+							       flags, NULL);
+		if (surface) {
+			data = cairo_surface_get_user_data(surface,
+							   &shm_surface_data_key);
+			goto out;
+		}
+	}
+
 	pool = shm_pool_create(display,
 			       data_length_for_shm_surface(rectangle));
 	if (!pool)
@@ -954,22 +1426,36 @@ struct shm_surface_leaf {
 
 	struct shm_pool *resize_pool;
 	int busy;
+
+	/* Number of frames posted since this leaf was last posted, 0 if
+	 * its contents are undefined. damage is the area that changed
+	 * in the meantime, in buffer coordinates. */
+	int age;
+	cairo_region_t *damage;
 };
 
 static void
-shm_surface_leaf_release(struct shm_surface_leaf *leaf)
+shm_surface_leaf_release(struct display *display,
+			 struct shm_surface_leaf *leaf)
 {
 	if (leaf->cairo_surface)
 		cairo_surface_destroy(leaf->cairo_surface);
 	/* leaf->data already destroyed via cairo private */
 
+	if (leaf->damage)
+		cairo_region_destroy(leaf->damage);
+
 	if (leaf->resize_pool)
-		shm_pool_destroy(leaf->resize_pool);
+		display_put_resize_pool(display, leaf->resize_pool);
 
 	memset(leaf, 0, sizeof *leaf);
 }
 
-#define MAX_LEAVES 3
+/* Leaves are only given storage when the server holds all others, so
+ * max_leaves is an upper bound on memory use rather than a fixed cost. */
+#define MIN_LEAVES 2
+#define DEFAULT_LEAVES 3
+#define MAX_LEAVES 8
 
 struct shm_surface {
 	struct toysurface base;
@@ -980,6 +1466,11 @@ struct shm_surface {
 
 	struct shm_surface_leaf leaf[MAX_LEAVES];
 	struct shm_surface_leaf *current;
+	struct shm_surface_leaf *front;
+	int max_leaves;
+
+	/* prepare() failed for lack of a free leaf */
+	int starved;
 };
 
 static struct shm_surface *
@@ -1012,6 +1503,9 @@ shm_surface_buffer_state_debug(struct shm_surface *surface, const char *msg)
 #endif
 }
 
+static void
+window_schedule_redraw_task(struct window *window);
+
 static void
 shm_surface_buffer_release(void *data, struct wl_buffer *buffer)
 {
@@ -1039,19 +1533,75 @@ shm_surface_buffer_release(void *data, struct wl_buffer *buffer)
 		if (!leaf->cairo_surface || leaf->busy)
 			continue;
 
-		if (!free_found)
+		if (!free_found && i < surface->max_leaves)
 			free_found = 1;
 		else
-			shm_surface_leaf_release(leaf);
+			shm_surface_leaf_release(surface->display, leaf);
 	}
 
 	shm_surface_buffer_state_debug(surface, "buffer_release  after");
+
+	/* The wl_surface user data is the window, see surface_create() */
+	if (surface->starved) {
+		surface->starved = 0;
+		window_schedule_redraw_task(
+			wl_surface_get_user_data(surface->surface));
+	}
 }
 
 static const struct wl_buffer_listener shm_surface_buffer_listener = {
 	shm_surface_buffer_release
 };
 
+static void
+shm_surface_leaf_invalidate(struct shm_surface_leaf *leaf)
+{
+	if (leaf->damage)
+		cairo_region_destroy(leaf->damage);
+	leaf->damage = NULL;
+	leaf->age = 0;
+}
+
+/* Bring an old leaf up to date with the last posted frame by copying
+ * over only the areas that changed since the leaf itself was posted. */
+static void
+shm_surface_leaf_copy_forward(struct shm_surface *surface,
+			      struct shm_surface_leaf *leaf)
+{
+	struct shm_surface_leaf *front = surface->front;
+	cairo_rectangle_int_t rect;
+	cairo_t *cr;
+	int i, n;
+
+	if (!front || front == leaf || !front->cairo_surface ||
+	    cairo_image_surface_get_width(front->cairo_surface) !=
+	    cairo_image_surface_get_width(leaf->cairo_surface) ||
+	    cairo_image_surface_get_height(front->cairo_surface) !=
+	    cairo_image_surface_get_height(leaf->cairo_surface)) {
+		shm_surface_leaf_invalidate(leaf);
+		return;
+	}
+
+	if (leaf->damage) {
+		cr = cairo_create(leaf->cairo_surface);
+		cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+		cairo_set_source_surface(cr, front->cairo_surface, 0, 0);
+		n = cairo_region_num_rectangles(leaf->damage);
+		for (i = 0; i < n; i++) {
+			cairo_region_get_rectangle(leaf->damage, i, &rect);
+			cairo_rectangle(cr, rect.x, rect.y,
+					rect.width, rect.height);
+		}
+		cairo_fill(cr);
+		cairo_destroy(cr);
+
+		cairo_region_destroy(leaf->damage);
+		leaf->damage = NULL;
+	}
+
+	leaf->age = 1;
+}
+
 static cairo_surface_t *
 shm_surface_prepare(struct toysurface *base, int dx, int dy,
 		    int32_t width, int32_t height, uint32_t flags,
@@ -1067,7 +1617,7 @@ shm_surface_prepare(struct toysurface *base, int dx, int dy,
 	surface->dy = dy;
 
 	/* pick a free buffer, preferably one that already has storage */
-	for (i = 0; i < MAX_LEAVES; i++) {
+	for (i = 0; i < surface->max_leaves; i++) {
 		if (surface->leaf[i].busy)
 			continue;
 
@@ -1078,17 +1628,20 @@ shm_surface_prepare(struct toysurface *base, int dx, int dy,
 		(int)(leaf - &surface->leaf[0]));
 
 	if (!leaf) {
-		fprintf(stderr, "%s: all buffers are held by the server.\n",
-			__func__);
-		exit(1);
+		/* Skip this frame; the redraw is retried once the server
+		 * releases a buffer. */
+		DBG_OBJ(surface->surface, "all buffers are held by the server\n");
+		surface->starved = 1;
+		surface->display->buffer_starvation_count++;
 		return NULL;
 	}
 
 	if (!resize_hint && leaf->resize_pool) {
 		cairo_surface_destroy(leaf->cairo_surface);
 		leaf->cairo_surface = NULL;
-		shm_pool_destroy(leaf->resize_pool);
+		display_put_resize_pool(surface->display, leaf->resize_pool);
 		leaf->resize_pool = NULL;
+		shm_surface_leaf_invalidate(leaf);
 	}
 
 	surface_to_buffer_size (buffer_transform, buffer_scale, &width, &height);
@@ -1100,23 +1653,34 @@ shm_surface_prepare(struct toysurface *base, int dx, int dy,
 
 	if (leaf->cairo_surface)
 		cairo_surface_destroy(leaf->cairo_surface);
+	shm_surface_leaf_invalidate(leaf);
+
+	rect.width = width;
+	rect.height = height;
 
 #ifdef USE_RESIZE_POOL
-	if (resize_hint && !leaf->resize_pool) {
-		/* Create a big pool to allocate from, while continuously
-		 * resizing. Mmapping a new pool in the server
-		 * is relatively expensive, so reusing a pool performs
-		 * better, but may temporarily reserve unneeded memory.
+	if (resize_hint) {
+		/* Allocate from a big pool while continuously resizing.
+		 * Mmapping a new pool in the server is relatively
+		 * expensive, so reusing a pool performs better, but may
+		 * temporarily reserve unneeded memory. Pools are sized
+		 * for the largest output and shared between windows.
 		 */
-		/* We should probably base this number on the output size. */
-		leaf->resize_pool = shm_pool_create(surface->display,
-						    6 * 1024 * 1024);
+		size_t length = data_length_for_shm_surface(&rect);
+
+		if (leaf->resize_pool && leaf->resize_pool->size < length) {
+			display_put_resize_pool(surface->display,
+						leaf->resize_pool);
+			leaf->resize_pool = NULL;
+		}
+
+		if (!leaf->resize_pool)
+			leaf->resize_pool =
+				display_get_resize_pool(surface->display,
+							length);
 	}
 #endif
 
-	rect.width = width;
-	rect.height = height;
-
 	leaf->cairo_surface =
 		display_create_shm_surface(surface->display, &rect,
 					   surface->flags,
@@ -1129,39 +1693,115 @@ shm_surface_prepare(struct toysurface *base, int dx, int dy,
 			       &shm_surface_buffer_listener, surface);
 
 out:
+	if (leaf->age > 1)
+		shm_surface_leaf_copy_forward(surface, leaf);
+
 	surface->current = leaf;
 
 	return cairo_surface_reference(leaf->cairo_surface);
 }
 
+static void
+shm_surface_damage(struct shm_surface *surface, cairo_region_t *damage)
+{
+	cairo_rectangle_int_t rect;
+	int i, n;
+
+	n = cairo_region_num_rectangles(damage);
+	for (i = 0; i < n; i++) {
+		cairo_region_get_rectangle(damage, i, &rect);
+		wl_surface_damage_buffer(surface->surface, rect.x, rect.y,
+					 rect.width, rect.height);
+	}
+}
+
 static void
 shm_surface_swap(struct toysurface *base,
 		 enum wl_output_transform buffer_transform, int32_t buffer_scale,
+		 cairo_region_t *damage,
 		 struct rectangle *server_allocation)
 {
 	struct shm_surface *surface = to_shm_surface(base);
 	struct shm_surface_leaf *leaf = surface->current;
+	struct shm_surface_leaf *other;
+	int32_t width, height;
+	int i;
 
-	server_allocation->width =
-		cairo_image_surface_get_width(leaf->cairo_surface);
-	server_allocation->height =
-		cairo_image_surface_get_height(leaf->cairo_surface);
+	width = cairo_image_surface_get_width(leaf->cairo_surface);
+	height = cairo_image_surface_get_height(leaf->cairo_surface);
 
 	buffer_to_surface_size (buffer_transform, buffer_scale,
-				&server_allocation->width,
-				&server_allocation->height);
+				&width, &height);
+
+	/* Partial damage is only meaningful against a previous buffer
+	 * of the same size. */
+	if (width != server_allocation->width ||
+	    height != server_allocation->height ||
+	    wl_surface_get_version(surface->surface) <
+	    WL_SURFACE_DAMAGE_BUFFER_SINCE_VERSION)
+		damage = NULL;
+
+	server_allocation->width = width;
+	server_allocation->height = height;
 
 	wl_surface_attach(surface->surface, leaf->data->buffer,
 			  surface->dx, surface->dy);
-	wl_surface_damage(surface->surface, 0, 0,
-			  server_allocation->width, server_allocation->height);
+	if (damage)
+		shm_surface_damage(surface, damage);
+	else
+		wl_surface_damage(surface->surface, 0, 0,
+				  server_allocation->width,
+				  server_allocation->height);
 	wl_surface_commit(surface->surface);
 
 	DBG_OBJ(surface->surface, "leaf %d busy\n",
 		(int)(leaf - &surface->leaf[0]));
 
+	/* Every other leaf now lags one more frame behind */
+	for (i = 0; i < MAX_LEAVES; i++) {
+		other = &surface->leaf[i];
+		if (other == leaf || other->age == 0)
+			continue;
+
+		if (!damage) {
+			shm_surface_leaf_invalidate(other);
+			continue;
+		}
+
+		if (!other->damage)
+			other->damage = cairo_region_create();
+		cairo_region_union(other->damage, damage);
+		other->age++;
+	}
+
+	shm_surface_leaf_invalidate(leaf);
+	leaf->age = 1;
+
 	leaf->busy = 1;
 	surface->current = NULL;
+	surface->front = leaf;
+}
+
+static int
+shm_surface_get_buffer_age(struct toysurface *base)
+{
+	struct shm_surface *surface = to_shm_surface(base);
+
+	return surface->current ? surface->current->age : 0;
+}
+
+static void
+shm_surface_set_max_buffers(struct toysurface *base, int count)
+{
+	struct shm_surface *surface = to_shm_surface(base);
+
+	if (count < MIN_LEAVES)
+		count = MIN_LEAVES;
+	if (count > MAX_LEAVES)
+		count = MAX_LEAVES;
+
+	/* Leaves beyond the new limit go away on their next release */
+	surface->max_leaves = count;
 }
 
 static int
@@ -1182,7 +1822,8 @@ shm_surface_destroy(struct toysurface *base)
 	int i;
 
 	for (i = 0; i < MAX_LEAVES; i++)
-		shm_surface_leaf_release(&surface->leaf[i]);
+		shm_surface_leaf_release(surface->display,
+					 &surface->leaf[i]);
 
 	free(surface);
 }
@@ -1197,6 +1838,8 @@ shm_surface_create(struct display *display, struct wl_surface *wl_surface,
 	surface = xzalloc(sizeof *surface);
 	surface->base.prepare = shm_surface_prepare;
 	surface->base.swap = shm_surface_swap;
+	surface->base.get_buffer_age = shm_surface_get_buffer_age;
+	surface->base.set_max_buffers = shm_surface_set_max_buffers;
 	surface->base.acquire = shm_surface_acquire;
 	surface->base.release = shm_surface_release;
 	surface->base.destroy = shm_surface_destroy;
@@ -1204,6 +1847,7 @@ shm_surface_create(struct display *display, struct wl_surface *wl_surface,
 	surface->display = display;
 	surface->surface = wl_surface;
 	surface->flags = flags;
+	surface->max_leaves = DEFAULT_LEAVES;
 
 	return &surface->base;
 }
@@ -1395,9 +2039,244 @@ display_get_pointer_image(struct display *display, int pointer)
 	return cursor ? cursor->images[0] : NULL;
 }
 
+enum trace_stage {
+	TRACE_INPUT,
+	TRACE_SCHEDULE_REDRAW,
+	TRACE_IDLE_REDRAW,
+	TRACE_WIDGET_REDRAW,
+	TRACE_STALE_REDRAW,
+	TRACE_SCROLL_REGION,
+	TRACE_SWAP,
+	TRACE_FRAME_DONE,
+};
+
+static const char * const trace_stage_names[] = {
+	[TRACE_INPUT] = "input",
+	[TRACE_SCHEDULE_REDRAW] = "schedule_redraw",
+	[TRACE_IDLE_REDRAW] = "idle_redraw",
+	[TRACE_WIDGET_REDRAW] = "widget_redraw",
+	[TRACE_STALE_REDRAW] = "stale_redraw",
+	[TRACE_SCROLL_REGION] = "scroll_region",
+	[TRACE_SWAP] = "swap",
+	[TRACE_FRAME_DONE] = "frame_done",
+};
+
+struct trace_event {
+	uint64_t time;		/* CLOCK_MONOTONIC, nsec */
+	uint64_t duration;	/* 0 for instant events */
+	enum trace_stage stage;
+};
+
+#define TRACE_EVENTS 4096
+
+/* Written only from the toytoolkit thread; head counts all events
+ * ever recorded, the ring keeps the last TRACE_EVENTS of them. */
+struct window_trace {
+	int id;
+	uint32_t head;
+	struct trace_event events[TRACE_EVENTS];
+};
+
+static uint64_t
+trace_get_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return timespec_to_nsec(&ts);
+}
+
+/* Returns the start time for window_trace_record(), 0 if not tracing */
+static uint64_t
+window_trace_begin(struct window *window)
+{
+	return window->trace ? trace_get_time() : 0;
+}
+
+/* Record a stage that began at start, or an instant event if start
+ * is 0 */
+static void
+window_trace_record(struct window *window, enum trace_stage stage,
+		    uint64_t start)
+{
+	struct window_trace *trace = window->trace;
+	struct trace_event *event;
+	uint64_t now;
+
+	if (!trace)
+		return;
+
+	now = trace_get_time();
+	event = &trace->events[trace->head % TRACE_EVENTS];
+	event->stage = stage;
+	event->time = start ? start : now;
+	event->duration = start ? now - start : 0;
+	trace->head++;
+}
+
+/* Worker threads that run render jobs. Whoever waits for a batch of
+ * jobs helps running queued jobs until the batch is done, so batches
+ * may be waited for from inside a job. */
+struct render_pool {
+	pthread_t *threads;
+	int count;
+	pthread_mutex_t mutex;
+	/* signalled on new jobs and on finished batches */
+	pthread_cond_t cond;
+	struct wl_list jobs;
+	int stop;
+};
+
+static struct render_job *
+render_pool_take_job(struct render_pool *pool)
+{
+	struct render_job *job;
+
+	if (wl_list_empty(&pool->jobs))
+		return NULL;
+
+	job = container_of(pool->jobs.next, struct render_job, link);
+	wl_list_remove(&job->link);
+
+	return job;
+}
+
+/* Called with the mutex held, drops it while the job runs */
+static void
+render_pool_run_job(struct render_pool *pool, struct render_job *job)
+{
+	struct render_batch *batch = job->batch;
+
+	pthread_mutex_unlock(&pool->mutex);
+	job->run(job);
+	pthread_mutex_lock(&pool->mutex);
+
+	if (--batch->pending == 0)
+		pthread_cond_broadcast(&pool->cond);
+}
+
+static void *
+render_pool_thread(void *data)
+{
+	struct render_pool *pool = data;
+	struct render_job *job;
+
+	pthread_mutex_lock(&pool->mutex);
+	while (!pool->stop) {
+		job = render_pool_take_job(pool);
+		if (job)
+			render_pool_run_job(pool, job);
+		else
+			pthread_cond_wait(&pool->cond, &pool->mutex);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+	return NULL;
+}
+
+static void
+render_pool_destroy(struct render_pool *pool)
+{
+	int i;
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->stop = 1;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->mutex);
+
+	for (i = 0; i < pool->count; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->mutex);
+	free(pool->threads);
+	free(pool);
+}
+
+static struct render_pool *
+render_pool_create(int count)
+{
+	struct render_pool *pool;
+
+	pool = xzalloc(sizeof *pool);
+	pool->threads = xzalloc(count * sizeof pool->threads[0]);
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+	wl_list_init(&pool->jobs);
+
+	for (pool->count = 0; pool->count < count; pool->count++) {
+		if (pthread_create(&pool->threads[pool->count], NULL,
+				   render_pool_thread, pool) != 0) {
+			fprintf(stderr, "creating render thread failed\n");
+			break;
+		}
+	}
+
+	if (pool->count == 0) {
+		render_pool_destroy(pool);
+		return NULL;
+	}
+
+	return pool;
+}
+
+static void
+render_pool_submit(struct render_pool *pool, struct render_batch *batch,
+		   struct render_job *job)
+{
+	pthread_mutex_lock(&pool->mutex);
+	job->batch = batch;
+	batch->pending++;
+	wl_list_insert(pool->jobs.prev, &job->link);
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+static void
+render_pool_wait(struct render_pool *pool, struct render_batch *batch)
+{
+	struct render_job *job;
+
+	pthread_mutex_lock(&pool->mutex);
+	while (batch->pending > 0) {
+		job = render_pool_take_job(pool);
+		if (job)
+			render_pool_run_job(pool, job);
+		else
+			pthread_cond_wait(&pool->cond, &pool->mutex);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+/* Tiled redraws: the redraw handler runs once per horizontal band of
+ * the buffer, each band being its own cairo image surface on the same
+ * memory, so the calls share no cairo state. */
+#define MAX_RENDER_TILES 16
+#define MIN_RENDER_TILE_HEIGHT 64
+
+struct render_tile {
+	struct render_job job;
+	struct widget *widget;
+	cairo_surface_t *cairo_surface;
+	int y;
+};
+
+static __thread struct render_tile *current_tile;
+
+/* Serializes damage and clip bookkeeping of redraws running on
+ * render threads. */
+static pthread_mutex_t render_damage_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static cairo_region_t *
+surface_get_buffer_damage(struct surface *surface);
+
 static void
 surface_flush(struct surface *surface)
 {
+	cairo_region_t *damage;
+	uint64_t start;
+
 	if (!surface->cairo_surface)
 		return;
 
@@ -1415,9 +2294,30 @@ surface_flush(struct surface *surface)
 		surface->input_region = NULL;
 	}
 
+	if (surface->scrolled) {
+		if (surface->damage) {
+			cairo_region_union(surface->damage, surface->scrolled);
+			cairo_region_destroy(surface->scrolled);
+		} else {
+			surface->damage = surface->scrolled;
+		}
+		surface->scrolled = NULL;
+	}
+
+	damage = surface_get_buffer_damage(surface);
+	start = window_trace_begin(surface->window);
 	surface->toysurface->swap(surface->toysurface,
 				  surface->buffer_transform, surface->buffer_scale,
-				  &surface->server_allocation);
+				  damage, &surface->server_allocation);
+	window_trace_record(surface->window, TRACE_SWAP, start);
+	if (damage)
+		cairo_region_destroy(damage);
+
+	if (surface->damage) {
+		cairo_region_destroy(surface->damage);
+		surface->damage = NULL;
+	}
+	surface->damage_all = 0;
 
 	cairo_surface_destroy(surface->cairo_surface);
 	surface->cairo_surface = NULL;
@@ -1459,10 +2359,14 @@ surface_create_surface(struct surface *surface, uint32_t flags)
 						  &allocation);
 	}
 
-	if (!surface->toysurface)
+	if (!surface->toysurface) {
 		surface->toysurface = shm_surface_create(display,
 							 surface->surface,
 							 flags, &allocation);
+		if (surface->max_buffers)
+			surface->toysurface->set_max_buffers(
+				surface->toysurface, surface->max_buffers);
+	}
 
 	surface->cairo_surface = surface->toysurface->prepare(
 		surface->toysurface, 0, 0,
@@ -1496,6 +2400,7 @@ window_set_buffer_transform(struct window *window,
 			    enum wl_output_transform transform)
 {
 	window->main_surface->buffer_transform = transform;
+	window->main_surface->damage_all = 1;
 	wl_surface_set_buffer_transform(window->main_surface->surface,
 					transform);
 }
@@ -1505,6 +2410,7 @@ window_set_buffer_scale(struct window *window,
 			int32_t scale)
 {
 	window->main_surface->buffer_scale = scale;
+	window->main_surface->damage_all = 1;
 	wl_surface_set_buffer_scale(window->main_surface->surface,
 				    scale);
 }
@@ -1545,6 +2451,12 @@ surface_destroy(struct surface *surface)
 	if (surface->opaque_region)
 		wl_region_destroy(surface->opaque_region);
 
+	if (surface->damage)
+		cairo_region_destroy(surface->damage);
+
+	if (surface->scrolled)
+		cairo_region_destroy(surface->scrolled);
+
 	if (surface->subsurface)
 		wl_subsurface_destroy(surface->subsurface);
 
@@ -1567,6 +2479,13 @@ window_destroy(struct window *window)
 
 	wl_list_remove(&window->redraw_task.link);
 
+	if (window->redraw_timer_initialized)
+		toytimer_fini(&window->redraw_timer);
+	if (window->presentation_feedback)
+		wp_presentation_feedback_destroy(window->presentation_feedback);
+
+	free(window->trace);
+
 	wl_list_for_each(input, &display->input_list, link) {
 		if (input->touch_focus == window)
 			input->touch_focus = NULL;
@@ -1766,10 +2685,10 @@ widget_get_cairo_surface(struct widget *widget)
 	return surface->cairo_surface;
 }
 
+/* The transformation from surface to buffer coordinates */
 static void
-widget_cairo_update_transform(struct widget *widget, cairo_t *cr)
+surface_get_buffer_matrix(struct surface *surface, cairo_matrix_t *matrix)
 {
-	struct surface *surface = widget->surface;
 	double angle;
 	cairo_matrix_t m;
 	enum wl_output_transform transform;
@@ -1839,9 +2758,76 @@ widget_cairo_update_transform(struct widget *widget, cairo_t *cr)
 		break;
 	}
 
-	cairo_scale(cr, scale, scale);
-	cairo_translate(cr, translate_x, translate_y);
-	cairo_rotate(cr, angle);
+	cairo_matrix_init_scale(matrix, scale, scale);
+	cairo_matrix_translate(matrix, translate_x, translate_y);
+	cairo_matrix_rotate(matrix, angle);
+	cairo_matrix_multiply(matrix, &m, matrix);
+}
+
+/* Translate the damage accumulated by widgets into buffer coordinates.
+ * Returns NULL when the whole buffer has to be damaged. */
+static cairo_region_t *
+surface_get_buffer_damage(struct surface *surface)
+{
+	cairo_region_t *damage;
+	cairo_rectangle_int_t rect;
+	cairo_matrix_t m;
+	double x1, y1, x2, y2;
+	int i, n;
+
+	if (surface->damage_all)
+		return NULL;
+
+	damage = cairo_region_create();
+	if (!surface->damage)
+		return damage;
+
+	surface_get_buffer_matrix(surface, &m);
+
+	n = cairo_region_num_rectangles(surface->damage);
+	for (i = 0; i < n; i++) {
+		cairo_region_get_rectangle(surface->damage, i, &rect);
+		x1 = rect.x - surface->allocation.x;
+		y1 = rect.y - surface->allocation.y;
+		x2 = x1 + rect.width;
+		y2 = y1 + rect.height;
+		cairo_matrix_transform_point(&m, &x1, &y1);
+		cairo_matrix_transform_point(&m, &x2, &y2);
+
+		rect.x = floor(MIN(x1, x2) + 0.5);
+		rect.y = floor(MIN(y1, y2) + 0.5);
+		rect.width = floor(MAX(x1, x2) + 0.5) - rect.x;
+		rect.height = floor(MAX(y1, y2) + 0.5) - rect.y;
+		cairo_region_union_rectangle(damage, &rect);
+	}
+
+	return damage;
+}
+
+static void
+surface_clip_to_damage(struct surface *surface, cairo_t *cr)
+{
+	cairo_rectangle_int_t rect;
+	int i, n;
+
+	cairo_new_path(cr);
+	if (surface->damage) {
+		n = cairo_region_num_rectangles(surface->damage);
+		for (i = 0; i < n; i++) {
+			cairo_region_get_rectangle(surface->damage, i, &rect);
+			cairo_rectangle(cr, rect.x, rect.y,
+					rect.width, rect.height);
+		}
+	}
+	cairo_clip(cr);
+}
+
+static void
+widget_cairo_update_transform(struct widget *widget, cairo_t *cr)
+{
+	cairo_matrix_t m;
+
+	surface_get_buffer_matrix(widget->surface, &m);
 	cairo_transform(cr, &m);
 }
 
@@ -1852,13 +2838,25 @@ widget_cairo_create(struct widget *widget)
 	cairo_surface_t *cairo_surface;
 	cairo_t *cr;
 
-	cairo_surface = widget_get_cairo_surface(widget);
-	cr = cairo_create(cairo_surface);
+	if (current_tile && current_tile->widget->surface == surface) {
+		cr = cairo_create(current_tile->cairo_surface);
+		cairo_translate(cr, 0, -current_tile->y);
+	} else {
+		cairo_surface = widget_get_cairo_surface(widget);
+		cr = cairo_create(cairo_surface);
+	}
 
 	widget_cairo_update_transform(widget, cr);
 
 	cairo_translate(cr, -surface->allocation.x, -surface->allocation.y);
 
+	if (surface->partial) {
+		pthread_mutex_lock(&render_damage_mutex);
+		surface_clip_to_damage(surface, cr);
+		surface->clip_used = 1;
+		pthread_mutex_unlock(&render_damage_mutex);
+	}
+
 	return cr;
 }
 
@@ -1895,6 +2893,145 @@ widget_input_region_add(struct widget *widget, const struct rectangle *rect)
 	}
 }
 
+void
+widget_damage_region(struct widget *widget, const struct rectangle *rect)
+{
+	struct surface *surface = widget->surface;
+	cairo_rectangle_int_t r;
+
+	if (!rect)
+		rect = &widget->allocation;
+
+	if (rect->width <= 0 || rect->height <= 0)
+		return;
+
+	r.x = rect->x;
+	r.y = rect->y;
+	r.width = rect->width;
+	r.height = rect->height;
+
+	pthread_mutex_lock(&render_damage_mutex);
+
+	if (!surface->damage)
+		surface->damage = cairo_region_create();
+
+	if (surface->clip_used &&
+	    cairo_region_contains_rectangle(surface->damage, &r) !=
+	    CAIRO_REGION_OVERLAP_IN)
+		surface->clip_stale = 1;
+
+	cairo_region_union_rectangle(surface->damage, &r);
+
+	pthread_mutex_unlock(&render_damage_mutex);
+}
+
+int
+widget_scroll_region(struct widget *widget, const struct rectangle *rect,
+		     int dy)
+{
+	struct surface *surface = widget->surface;
+	cairo_surface_t *target;
+	cairo_rectangle_int_t r;
+	cairo_format_t format;
+	unsigned char *data;
+	int x, y, width, height, stride, scale, i, n;
+
+	/* Only a buffer holding the previous frame can be moved, and only
+	 * before anything has been drawn into it */
+	if (!surface->partial || surface->clip_used || current_tile ||
+	    surface->buffer_transform != WL_OUTPUT_TRANSFORM_NORMAL)
+		return 0;
+
+	target = widget_get_cairo_surface(widget);
+	if (!target ||
+	    cairo_surface_get_type(target) != CAIRO_SURFACE_TYPE_IMAGE)
+		return 0;
+
+	format = cairo_image_surface_get_format(target);
+	if (format != CAIRO_FORMAT_ARGB32 && format != CAIRO_FORMAT_RGB24)
+		return 0;
+
+	scale = surface->buffer_scale;
+	x = (rect->x - surface->allocation.x) * scale;
+	y = (rect->y - surface->allocation.y) * scale;
+	width = rect->width * scale;
+	height = rect->height * scale;
+	if (x < 0 || y < 0 ||
+	    x + width > cairo_image_surface_get_width(target) ||
+	    y + height > cairo_image_surface_get_height(target))
+		return 0;
+
+	dy *= scale;
+	if (abs(dy) >= height)
+		return 0;
+	if (dy == 0)
+		return 1;
+
+	cairo_surface_flush(target);
+	data = cairo_image_surface_get_data(target);
+	stride = cairo_image_surface_get_stride(target);
+	n = height - abs(dy);
+
+	if (dy < 0) {
+		for (i = 0; i < n; i++)
+			memcpy(data + (y + i) * stride + x * 4,
+			       data + (y + i - dy) * stride + x * 4,
+			       width * 4);
+	} else {
+		for (i = n - 1; i >= 0; i--)
+			memcpy(data + (y + i + dy) * stride + x * 4,
+			       data + (y + i) * stride + x * 4,
+			       width * 4);
+	}
+
+	cairo_surface_mark_dirty(target);
+
+	r.x = rect->x;
+	r.y = rect->y;
+	r.width = rect->width;
+	r.height = rect->height;
+
+	pthread_mutex_lock(&render_damage_mutex);
+	if (!surface->scrolled)
+		surface->scrolled = cairo_region_create();
+	cairo_region_union_rectangle(surface->scrolled, &r);
+	pthread_mutex_unlock(&render_damage_mutex);
+
+	if (!surface->threaded)
+		window_trace_record(widget->window, TRACE_SCROLL_REGION, 0);
+
+	return 1;
+}
+
+void
+widget_set_damage_tracking(struct widget *widget, int tracking)
+{
+	widget->damage_tracking = tracking;
+}
+
+void
+widget_set_thread_safe(struct widget *widget, int thread_safe)
+{
+	widget->thread_safe = thread_safe;
+}
+
+void
+widget_set_tiled_redraw(struct widget *widget, int tiled)
+{
+	widget->tiled = tiled;
+}
+
+void
+widget_set_max_buffers(struct widget *widget, int count)
+{
+	struct surface *surface = widget->surface;
+
+	surface->max_buffers = count;
+	if (surface->toysurface)
+		surface->toysurface->set_max_buffers(surface->toysurface,
+						     count);
+}
+
 void
 widget_set_resize_handler(struct widget *widget,
 			  widget_resize_handler_t handler)
@@ -1909,6 +3046,13 @@ widget_set_redraw_handler(struct widget *widget,
 	widget->redraw_handler = handler;
 }
 
+void
+widget_set_prepare_redraw_handler(struct widget *widget,
+				  widget_prepare_redraw_handler_t handler)
+{
+	widget->prepare_redraw_handler = handler;
+}
+
 void
 widget_set_enter_handler(struct widget *widget, widget_enter_handler_t handler)
 {
@@ -1997,14 +3141,17 @@ widget_set_axis_handlers(struct widget *widget,
 	widget->axis_discrete_handler = axis_discrete_handler;
 }
 
-static void
-window_schedule_redraw_task(struct window *window);
-
 void
 widget_schedule_redraw(struct widget *widget)
 {
 	DBG_OBJ(widget->surface->surface, "widget %p\n", widget);
 	widget->surface->redraw_needed = 1;
+
+	/* On a render thread only mark the surface; its frame callback
+	 * schedules the redraw from the main thread. */
+	if (widget->surface->threaded)
+		return;
+
 	window_schedule_redraw_task(widget->window);
 }
 
@@ -2256,6 +3403,11 @@ frame_redraw_handler(struct widget *widget, void *data)
 	if (window->fullscreen)
 		return;
 
+	/* frame_repaint() clears the repaint status, so the decorations
+	 * are unchanged unless it is set now. */
+	if (frame_status(frame->frame) & FRAME_STATUS_REPAINT)
+		widget_damage_region(widget, NULL);
+
 	cr = widget_cairo_create(widget);
 
 	frame_repaint(frame->frame, cr);
@@ -2525,6 +3677,7 @@ window_frame_create(struct window *window, void *data)
 	frame->child = widget_add_widget(frame->widget, data);
 
 	widget_set_redraw_handler(frame->widget, frame_redraw_handler);
+	widget_set_damage_tracking(frame->widget, 1);
 	widget_set_resize_handler(frame->widget, frame_resize_handler);
 	widget_set_enter_handler(frame->widget, frame_enter_handler);
 	widget_set_leave_handler(frame->widget, frame_leave_handler);
@@ -2744,6 +3897,8 @@ pointer_handle_motion(void *data, struct wl_pointer *pointer,
 	if (!window)
 		return;
 
+	window_trace_record(window, TRACE_INPUT, 0);
+
 	input->sx = sx;
 	input->sy = sy;
 
@@ -2789,6 +3944,9 @@ pointer_handle_button(void *data, struct wl_pointer *pointer, uint32_t serial,
 	enum wl_pointer_button_state state = state_w;
 
 	input->display->serial = serial;
+	if (input->pointer_focus)
+		window_trace_record(input->pointer_focus, TRACE_INPUT, 0);
+
 	if (input->focus_widget && input->grab == NULL &&
 	    state == WL_POINTER_BUTTON_STATE_PRESSED)
 		input_grab(input, input->focus_widget, button);
@@ -2812,6 +3970,9 @@ pointer_handle_axis(void *data, struct wl_pointer *pointer,
 	struct input *input = data;
 	struct widget *widget;
 
+	if (input->pointer_focus)
+		window_trace_record(input->pointer_focus, TRACE_INPUT, 0);
+
 	widget = input->focus_widget;
 	if (input->grab)
 		widget = input->grab;
@@ -3109,6 +4270,8 @@ keyboard_handle_key(void *data, struct wl_keyboard *keyboard,
 	if (!window || !input->xkb.state)
 		return;
 
+	window_trace_record(window, TRACE_INPUT, 0);
+
 	/* We only use input grabs for pointer events for now, so just
 	 * ignore key presses if a grab is active.  We expand the key
 	 * event delivery mechanism to route events to widgets to
@@ -3249,6 +4412,8 @@ touch_handle_down(void *data, struct wl_touch *wl_touch,
 		return;
 	}
 
+	window_trace_record(input->touch_focus, TRACE_INPUT, 0);
+
 	if (input->grab)
 		widget = input->grab;
 	else
@@ -3285,6 +4450,8 @@ touch_handle_up(void *data, struct wl_touch *wl_touch,
 		return;
 	}
 
+	window_trace_record(input->touch_focus, TRACE_INPUT, 0);
+
 	wl_list_for_each_safe(tp, tmp, &input->touch_point_list, link) {
 		if (tp->id != id)
 			continue;
@@ -3317,6 +4484,8 @@ touch_handle_motion(void *data, struct wl_touch *wl_touch,
 		return;
 	}
 
+	window_trace_record(input->touch_focus, TRACE_INPUT, 0);
+
 	wl_list_for_each(tp, &input->touch_point_list, link) {
 		if (tp->id != id)
 			continue;
@@ -3946,6 +5115,7 @@ data_offer_receive_data(struct data_offer *offer, const char *mime_type,
 	close(p[1]);
 
 	offer->io_task.run = offer_io_func;
+	offer->io_task.priority = TASK_PRIORITY_LOW;
 	offer->fd = p[0];
 	offer->func = func;
 	offer->refcount++;
@@ -4216,10 +5386,18 @@ window_get_shadow_margin(struct window *window)
 		return 0;
 }
 
+static void
+window_cancel_redraw_timer(struct window *window)
+{
+	if (window->redraw_timer_initialized)
+		toytimer_disarm(&window->redraw_timer);
+}
+
 void
 window_inhibit_redraw(struct window *window)
 {
 	window->redraw_inhibited = 1;
+	window_cancel_redraw_timer(window);
 	wl_list_remove(&window->redraw_task.link);
 	wl_list_init(&window->redraw_task.link);
 	window->redraw_task_scheduled = 0;
@@ -4377,21 +5555,79 @@ window_sync_geometry(struct window *window)
 	    geometry.height == window->last_geometry.height)
 		return;
 
-	xdg_surface_set_window_geometry(window->xdg_surface,
-					geometry.x,
-					geometry.y,
-					geometry.width,
-					geometry.height);
-	window->last_geometry = geometry;
+	xdg_surface_set_window_geometry(window->xdg_surface,
+					geometry.x,
+					geometry.y,
+					geometry.width,
+					geometry.height);
+	window->last_geometry = geometry;
+}
+
+static void
+presentation_feedback_sync_output(void *data,
+				  struct wp_presentation_feedback *feedback,
+				  struct wl_output *output)
+{
+}
+
+static void
+presentation_feedback_presented(void *data,
+				struct wp_presentation_feedback *feedback,
+				uint32_t tv_sec_hi,
+				uint32_t tv_sec_lo,
+				uint32_t tv_nsec,
+				uint32_t refresh_nsec,
+				uint32_t seq_hi,
+				uint32_t seq_lo,
+				uint32_t flags)
+{
+	struct window *window = data;
+
+	timespec_from_proto(&window->last_presentation,
+			    tv_sec_hi, tv_sec_lo, tv_nsec);
+	window->refresh_nsec = refresh_nsec;
+
+	wp_presentation_feedback_destroy(feedback);
+	window->presentation_feedback = NULL;
+}
+
+static void
+presentation_feedback_discarded(void *data,
+				struct wp_presentation_feedback *feedback)
+{
+	struct window *window = data;
+
+	wp_presentation_feedback_destroy(feedback);
+	window->presentation_feedback = NULL;
 }
 
+static const struct wp_presentation_feedback_listener
+presentation_feedback_listener = {
+	presentation_feedback_sync_output,
+	presentation_feedback_presented,
+	presentation_feedback_discarded
+};
+
 static void
 window_flush(struct window *window)
 {
 	struct surface *surface;
+	struct display *display = window->display;
 
 	assert(!window->redraw_inhibited);
 
+	/* One outstanding feedback is enough to follow the refresh */
+	if (window->redraw_margin_usec > 0 && display->presentation &&
+	    !window->presentation_feedback &&
+	    window->main_surface->cairo_surface) {
+		window->presentation_feedback =
+			wp_presentation_feedback(display->presentation,
+						 window->main_surface->surface);
+		wp_presentation_feedback_add_listener(
+			window->presentation_feedback,
+			&presentation_feedback_listener, window);
+	}
+
 	if (!window->custom) {
 		if (window->xdg_surface)
 			window_sync_geometry(window);
@@ -4425,17 +5661,133 @@ window_get_allocation(struct window *window,
 	*allocation = window->main_surface->allocation;
 }
 
+static void
+render_tile_run(struct render_job *job)
+{
+	struct render_tile *tile = container_of(job, struct render_tile, job);
+	struct widget *widget = tile->widget;
+
+	current_tile = tile;
+	widget->redraw_handler(widget, widget->user_data);
+	current_tile = NULL;
+}
+
+/* Run the redraw handler once per band of the buffer, spread over the
+ * render pool. Returns 0 if the widget has to be drawn in one go. */
+static int
+widget_redraw_tiled(struct widget *widget)
+{
+	struct render_pool *pool = widget->window->display->render_pool;
+	struct render_tile tiles[MAX_RENDER_TILES];
+	struct render_batch batch = { 0 };
+	cairo_surface_t *target;
+	cairo_format_t format;
+	unsigned char *data;
+	int width, height, stride, count, band, i;
+
+	if (!pool || !widget->use_cairo || current_tile)
+		return 0;
+
+	target = widget_get_cairo_surface(widget);
+	if (!target ||
+	    cairo_surface_get_type(target) != CAIRO_SURFACE_TYPE_IMAGE)
+		return 0;
+
+	height = cairo_image_surface_get_height(target);
+	count = MIN(pool->count + 1, height / MIN_RENDER_TILE_HEIGHT);
+	count = MIN(count, MAX_RENDER_TILES);
+	if (count < 2)
+		return 0;
+
+	cairo_surface_flush(target);
+	data = cairo_image_surface_get_data(target);
+	format = cairo_image_surface_get_format(target);
+	width = cairo_image_surface_get_width(target);
+	stride = cairo_image_surface_get_stride(target);
+	band = (height + count - 1) / count;
+
+	for (i = 0; i < count; i++) {
+		tiles[i].widget = widget;
+		tiles[i].y = i * band;
+		tiles[i].cairo_surface =
+			cairo_image_surface_create_for_data(data +
+							    tiles[i].y * stride,
+							    format, width,
+							    MIN(band,
+								height - tiles[i].y),
+							    stride);
+		tiles[i].job.run = render_tile_run;
+		if (i > 0)
+			render_pool_submit(pool, &batch, &tiles[i].job);
+	}
+
+	tiles[0].job.batch = &batch;
+	render_tile_run(&tiles[0].job);
+	render_pool_wait(pool, &batch);
+
+	for (i = 0; i < count; i++)
+		cairo_surface_destroy(tiles[i].cairo_surface);
+	cairo_surface_mark_dirty(target);
+
+	return 1;
+}
+
 static void
 widget_redraw(struct widget *widget)
 {
 	struct widget *child;
 
-	if (widget->redraw_handler)
-		widget->redraw_handler(widget, widget->user_data);
+	if (widget->redraw_handler) {
+		if (!widget->tiled || !widget_redraw_tiled(widget))
+			widget->redraw_handler(widget, widget->user_data);
+		if (!widget->damage_tracking)
+			widget->surface->damage_all = 1;
+	}
 	wl_list_for_each(child, &widget->child_list, link)
 		widget_redraw(child);
 }
 
+static void
+widget_prepare_redraw(struct widget *widget)
+{
+	struct widget *child;
+
+	if (widget->prepare_redraw_handler)
+		widget->prepare_redraw_handler(widget, widget->user_data);
+	wl_list_for_each(child, &widget->child_list, link)
+		widget_prepare_redraw(child);
+}
+
+static int
+widget_tracks_damage(struct widget *widget)
+{
+	struct widget *child;
+
+	if (widget->redraw_handler && !widget->damage_tracking)
+		return 0;
+
+	wl_list_for_each(child, &widget->child_list, link)
+		if (!widget_tracks_damage(child))
+			return 0;
+
+	return 1;
+}
+
+/* Only repaint the damaged area when the buffer still holds the
+ * previous frame and all widgets tell us what they are going to change.
+ */
+static int
+surface_can_redraw_partial(struct surface *surface)
+{
+	if (surface->damage_all || !surface->cairo_surface)
+		return 0;
+
+	if (surface->toysurface->get_buffer_age(surface->toysurface) != 1)
+		return 0;
+
+	return widget_tracks_damage(surface->widget);
+}
+
 static void
 frame_callback(void *data, struct wl_callback *callback, uint32_t time)
 {
@@ -4447,6 +5799,7 @@ frame_callback(void *data, struct wl_callback *callback, uint32_t time)
 	surface->frame_cb = NULL;
 
 	surface->last_time = time;
+	window_trace_record(surface->window, TRACE_FRAME_DONE, 0);
 
 	if (surface->redraw_needed || surface->window->redraw_needed) {
 		DBG_OBJ(surface->surface, "window_schedule_redraw_task\n");
@@ -4458,8 +5811,11 @@ static const struct wl_callback_listener listener = {
 	frame_callback
 };
 
+/* The part of a surface redraw that must run on the main thread: frame
+ * callback and buffer. Returns 1 if the widgets need to be drawn, 0 if
+ * not, and -1 on buffer failure. */
 static int
-surface_redraw(struct surface *surface)
+surface_redraw_prepare(struct surface *surface)
 {
 	DBG_OBJ(surface->surface, "begin\n");
 
@@ -4488,12 +5844,99 @@ surface_redraw(struct surface *surface)
 	DBG_OBJ(surface->frame_cb, "new\n");
 
 	surface->redraw_needed = 0;
+	surface->partial = surface_can_redraw_partial(surface);
+	widget_prepare_redraw(surface->widget);
+	return 1;
+}
+
+static void
+surface_redraw_widgets(struct surface *surface)
+{
 	DBG_OBJ(surface->surface, "-> widget_redraw\n");
 	widget_redraw(surface->widget);
+	if (surface->clip_stale) {
+		/* Damage grew after drawing had started, so some of it
+		 * may have been clipped away; repaint unclipped. */
+		DBG_OBJ(surface->surface, "clip stale, redrawing\n");
+		if (!surface->threaded)
+			window_trace_record(surface->window,
+					    TRACE_STALE_REDRAW, 0);
+		surface->partial = 0;
+		widget_redraw(surface->widget);
+	}
+	surface->partial = 0;
+	surface->clip_used = 0;
+	surface->clip_stale = 0;
 	DBG_OBJ(surface->surface, "done\n");
+}
+
+static void
+surface_render_job_run(struct render_job *job)
+{
+	struct surface *surface = container_of(job, struct surface, render_job);
+
+	surface_redraw_widgets(surface);
+}
+
+static int
+surface_redraw(struct surface *surface)
+{
+	uint64_t start;
+	int ret;
+
+	ret = surface_redraw_prepare(surface);
+	if (ret <= 0)
+		return ret;
+
+	start = window_trace_begin(surface->window);
+	surface_redraw_widgets(surface);
+	window_trace_record(surface->window, TRACE_WIDGET_REDRAW, start);
+
 	return 0;
 }
 
+static int
+widget_is_thread_safe(struct widget *widget)
+{
+	struct widget *child;
+
+	if (widget->redraw_handler && !widget->thread_safe)
+		return 0;
+
+	wl_list_for_each(child, &widget->child_list, link)
+		if (!widget_is_thread_safe(child))
+			return 0;
+
+	return 1;
+}
+
+/* Hand subsurfaces whose widgets are all thread safe to the render
+ * pool. Returns the number of jobs submitted. */
+static int
+window_redraw_threaded(struct window *window, struct render_batch *batch)
+{
+	struct render_pool *pool = window->display->render_pool;
+	struct surface *surface;
+	int count = 0;
+
+	wl_list_for_each(surface, &window->subsurface_list, link) {
+		if (surface == window->main_surface ||
+		    !surface->widget->use_cairo ||
+		    !widget_is_thread_safe(surface->widget))
+			continue;
+
+		surface->threaded = 1;
+		if (surface_redraw_prepare(surface) <= 0)
+			continue;
+
+		surface->render_job.run = surface_render_job_run;
+		render_pool_submit(pool, batch, &surface->render_job);
+		count++;
+	}
+
+	return count;
+}
+
 static void
 idle_redraw(struct task *task, uint32_t events)
 {
@@ -4501,9 +5944,15 @@ idle_redraw(struct task *task, uint32_t events)
 	struct surface *surface;
 	int failed = 0;
 	int resized = 0;
+	int threaded = 0;
+	struct render_batch batch = { 0 };
+	int ret;
+	uint64_t start = window_trace_begin(window);
+	uint64_t threaded_start, redraw_start;
 
 	DBG(" --------- \n");
 
+	window_cancel_redraw_timer(window);
 	wl_list_init(&window->redraw_task.link);
 	window->redraw_task_scheduled = 0;
 
@@ -4518,7 +5967,8 @@ idle_redraw(struct task *task, uint32_t events)
 		resized = 1;
 	}
 
-	if (surface_redraw(window->main_surface) < 0) {
+	ret = surface_redraw_prepare(window->main_surface);
+	if (ret < 0) {
 		/*
 		 * Only main_surface failure will cause us to undo the resize.
 		 * If sub-surfaces fail, they will just be broken with old
@@ -4526,12 +5976,35 @@ idle_redraw(struct task *task, uint32_t events)
 		 */
 		failed = 1;
 	} else {
+		threaded_start = window_trace_begin(window);
+		if (window->display->render_pool)
+			threaded = window_redraw_threaded(window, &batch);
+
+		if (ret > 0) {
+			redraw_start = window_trace_begin(window);
+			surface_redraw_widgets(window->main_surface);
+			window_trace_record(window, TRACE_WIDGET_REDRAW,
+					    redraw_start);
+		}
+
 		wl_list_for_each(surface, &window->subsurface_list, link) {
 			if (surface == window->main_surface)
 				continue;
 
+			if (surface->threaded)
+				continue;
+
 			surface_redraw(surface);
 		}
+
+		if (threaded) {
+			render_pool_wait(window->display->render_pool, &batch);
+			window_trace_record(window, TRACE_WIDGET_REDRAW,
+					    threaded_start);
+		}
+
+		wl_list_for_each(surface, &window->subsurface_list, link)
+			surface->threaded = 0;
 	}
 
 	window->redraw_needed = 0;
@@ -4544,6 +6017,61 @@ idle_redraw(struct task *task, uint32_t events)
 		/* Restore widget tree to correspond to what is on screen. */
 		undo_resize(window);
 	}
+
+	window_trace_record(window, TRACE_IDLE_REDRAW, start);
+}
+
+static void
+redraw_timer_func(struct toytimer *tt)
+{
+	struct window *window = container_of(tt, struct window, redraw_timer);
+
+	/* The timer is disarmed whenever the task gets run, deferred or
+	 * unscheduled otherwise, but don't trust a late expiry */
+	if (window->redraw_inhibited || !window->redraw_task_scheduled ||
+	    !wl_list_empty(&window->redraw_task.link))
+		return;
+
+	display_defer(window->display, &window->redraw_task);
+}
+
+/* Delay the redraw so that it starts redraw_margin_usec before the
+ * next refresh predicted from presentation feedback. Returns 0 if the
+ * redraw should run right away. */
+static int
+window_pace_redraw(struct window *window)
+{
+	struct display *display = window->display;
+	struct timespec now;
+	int64_t margin, since, start;
+
+	if (window->redraw_margin_usec <= 0 || window->refresh_nsec == 0)
+		return 0;
+
+	clock_gettime(display->presentation_clock, &now);
+	margin = (int64_t) window->redraw_margin_usec * 1000;
+
+	/* Start of the redraw for the first refresh we can still make,
+	 * relative to now. */
+	since = timespec_sub_to_nsec(&now, &window->last_presentation);
+	start = window->refresh_nsec - margin -
+		(since % window->refresh_nsec);
+	while (start < 0)
+		start += window->refresh_nsec;
+
+	if (start < 1000)
+		return 0;
+
+	/* The delay is relative, so the timer need not use the
+	 * presentation clock, which timerfd may not support. */
+	if (!window->redraw_timer_initialized) {
+		toytimer_init(&window->redraw_timer, CLOCK_MONOTONIC, display,
+			      redraw_timer_func);
+		window->redraw_timer_initialized = 1;
+	}
+	toytimer_arm_once_usec(&window->redraw_timer, start / 1000);
+
+	return 1;
 }
 
 static void
@@ -4552,13 +6080,36 @@ window_schedule_redraw_task(struct window *window)
 	if (window->redraw_inhibited)
 		return;
 
+	window_trace_record(window, TRACE_SCHEDULE_REDRAW, 0);
+
 	if (!window->redraw_task_scheduled) {
 		window->redraw_task.run = idle_redraw;
-		display_defer(window->display, &window->redraw_task);
+		if (!window_pace_redraw(window)) {
+			window_cancel_redraw_timer(window);
+			display_defer(window->display, &window->redraw_task);
+		}
 		window->redraw_task_scheduled = 1;
 	}
 }
 
+void
+window_set_tracing(struct window *window, int enable)
+{
+	if (enable && !window->trace) {
+		window->trace = xzalloc(sizeof *window->trace);
+		window->trace->id = ++window->display->trace_next_id;
+	} else if (!enable && window->trace) {
+		free(window->trace);
+		window->trace = NULL;
+	}
+}
+
+void
+window_set_redraw_margin(struct window *window, int32_t margin_usec)
+{
+	window->redraw_margin_usec = margin_usec;
+}
+
 void
 window_schedule_redraw(struct window *window)
 {
@@ -5174,6 +6725,9 @@ window_create_internal(struct display *display, int custom)
 
 	wl_list_init (&window->window_output_list);
 
+	if (display->trace_path)
+		window_set_tracing(window, 1);
+
 	return window;
 }
 
@@ -5614,6 +7168,12 @@ display_handle_mode(void *data,
 	struct output *output = data;
 	struct display *display = output->display;
 
+	if ((int64_t) width * height >
+	    (int64_t) output->max_mode_width * output->max_mode_height) {
+		output->max_mode_width = width;
+		output->max_mode_height = height;
+	}
+
 	if (flags & WL_OUTPUT_MODE_CURRENT) {
 		output->allocation.width = width;
 		output->allocation.height = height;
@@ -5829,6 +7389,7 @@ display_add_input(struct display *d, uint32_t id, int display_seat_version)
 	set_repeat_info(input, 40, 400);
 	toytimer_init(&input->repeat_timer, CLOCK_MONOTONIC, d,
 		      keyboard_repeat_func);
+	input->repeat_timer.tsk.priority = TASK_PRIORITY_HIGH;
 }
 
 static void
@@ -5922,6 +7483,19 @@ static const struct xdg_wm_base_listener wm_base_listener = {
 	xdg_wm_base_ping,
 };
 
+static void
+presentation_clock_id(void *data, struct wp_presentation *presentation,
+		      uint32_t clk_id)
+{
+	struct display *d = data;
+
+	d->presentation_clock = clk_id;
+}
+
+static const struct wp_presentation_listener presentation_listener = {
+	presentation_clock_id
+};
+
 static void
 registry_handle_global(void *data, struct wl_registry *registry, uint32_t id,
 		       const char *interface, uint32_t version)
@@ -5937,7 +7511,8 @@ registry_handle_global(void *data, struct wl_registry *registry, uint32_t id,
 
 	if (strcmp(interface, "wl_compositor") == 0) {
 		d->compositor = wl_registry_bind(registry, id,
-						 &wl_compositor_interface, 3);
+						 &wl_compositor_interface,
+						 MIN(version, 4));
 	} else if (strcmp(interface, "wl_output") == 0) {
 		display_add_output(d, id);
 	} else if (strcmp(interface, "wl_seat") == 0) {
@@ -5971,6 +7546,12 @@ registry_handle_global(void *data, struct wl_registry *registry, uint32_t id,
 		d->subcompositor =
 			wl_registry_bind(registry, id,
 					 &wl_subcompositor_interface, 1);
+	} else if (strcmp(interface, "wp_presentation") == 0) {
+		d->presentation =
+			wl_registry_bind(registry, id,
+					 &wp_presentation_interface, 1);
+		wp_presentation_add_listener(d->presentation,
+					     &presentation_listener, d);
 	}
 
 	if (d->global_handler)
@@ -6157,6 +7738,147 @@ log_handler(const char *format, va_list args)
 	vfprintf(stderr, format, args);
 }
 
+static void
+trace_write_string(FILE *fp, const char *str)
+{
+	fputc('"', fp);
+	for (; str && *str; str++) {
+		if (*str == '"' || *str == '\\')
+			fprintf(fp, "\\%c", *str);
+		else if ((unsigned char) *str < 0x20)
+			fprintf(fp, "\\u%04x", *str);
+		else
+			fputc(*str, fp);
+	}
+	fputc('"', fp);
+}
+
+int
+display_write_trace(struct display *display, const char *filename)
+{
+	struct window *window;
+	struct window_trace *trace;
+	struct trace_event *event;
+	uint32_t i;
+	int pid = getpid();
+	const char *sep = "";
+	FILE *fp;
+
+	fp = fopen(filename, "w");
+	if (!fp) {
+		fprintf(stderr, "could not open %s: %s\n",
+			filename, strerror(errno));
+		return -1;
+	}
+
+	fprintf(fp, "{\"traceEvents\":[");
+	wl_list_for_each(window, &display->window_list, link) {
+		trace = window->trace;
+		if (!trace)
+			continue;
+
+		fprintf(fp, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\","
+			"\"pid\":%d,\"tid\":%d,\"args\":{\"name\":",
+			sep, pid, trace->id);
+		trace_write_string(fp, window->title ? window->title : "window");
+		fprintf(fp, "}}");
+		sep = ",";
+
+		i = trace->head > TRACE_EVENTS ? trace->head - TRACE_EVENTS : 0;
+		for (; i < trace->head; i++) {
+			event = &trace->events[i % TRACE_EVENTS];
+			fprintf(fp, ",\n{\"name\":\"%s\",\"cat\":\"toytoolkit\","
+				"\"pid\":%d,\"tid\":%d,\"ts\":%.3f,",
+				trace_stage_names[event->stage], pid, trace->id,
+				event->time / 1000.0);
+			if (event->duration)
+				fprintf(fp, "\"ph\":\"X\",\"dur\":%.3f}",
+					event->duration / 1000.0);
+			else
+				fprintf(fp, "\"ph\":\"i\",\"s\":\"t\"}");
+		}
+	}
+	fprintf(fp, "\n]}\n");
+
+	return fclose(fp) == 0 ? 0 : -1;
+}
+
+static void
+trace_atfork_child(void)
+{
+	sigset_t mask;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGUSR1);
+	sigprocmask(SIG_UNBLOCK, &mask, NULL);
+}
+
+static void
+handle_trace_signal(struct task *task, uint32_t events)
+{
+	struct display *display =
+		container_of(task, struct display, trace_task);
+	struct signalfd_siginfo si;
+
+	if (read(display->trace_signal_fd, &si, sizeof si) != sizeof si)
+		return;
+
+	if (display_write_trace(display, display->trace_path) == 0)
+		fprintf(stderr, "trace written to %s\n", display->trace_path);
+}
+
+/* SIGUSR1 is blocked and read from a signalfd, so the trace is
+ * written from the main loop rather than a signal handler. */
+static void
+display_init_tracing(struct display *display)
+{
+	const char *env = getenv("TOYTOOLKIT_TRACE");
+	static int atfork_registered;
+	sigset_t mask, old_mask;
+	char *path;
+
+	if (!env || !*env)
+		return;
+
+	/* Clients we launch would trace as well and write the same
+	 * file, so keep the variable to ourselves */
+	path = strdup(env);
+	unsetenv("TOYTOOLKIT_TRACE");
+	if (!path)
+		return;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGUSR1);
+	if (sigprocmask(SIG_BLOCK, &mask, &old_mask) < 0) {
+		fprintf(stderr, "blocking SIGUSR1 failed: %s\n",
+			strerror(errno));
+		free(path);
+		return;
+	}
+
+	/* The mask is inherited across fork() and exec(); the shells and
+	 * clients we launch get SIGUSR1 back the way they would have had
+	 * it without tracing */
+	if (!sigismember(&old_mask, SIGUSR1) && !atfork_registered) {
+		pthread_atfork(NULL, NULL, trace_atfork_child);
+		atfork_registered = 1;
+	}
+
+	display->trace_signal_fd = signalfd(-1, &mask,
+					    SFD_CLOEXEC | SFD_NONBLOCK);
+	if (display->trace_signal_fd < 0) {
+		fprintf(stderr, "creating signalfd failed: %s\n",
+			strerror(errno));
+		free(path);
+		return;
+	}
+
+	display->trace_path = path;
+	display->trace_task.run = handle_trace_signal;
+	display_watch_fd(display, display->trace_signal_fd, EPOLLIN,
+			 &display->trace_task);
+}
+
 struct display *
 display_create(int *argc, char *argv[])
 {
@@ -6184,8 +7906,12 @@ display_create(int *argc, char *argv[])
 	}
 
 	d->epoll_fd = os_epoll_create_cloexec();
+	d->epoll_events_size = MIN_EPOLL_EVENTS;
+	d->epoll_events = xmalloc(d->epoll_events_size *
+				  sizeof d->epoll_events[0]);
 	d->display_fd = wl_display_get_fd(d->display);
 	d->display_task.run = handle_display_data;
+	d->display_task.priority = TASK_PRIORITY_HIGH;
 	display_watch_fd(d, d->display_fd, EPOLLIN | EPOLLERR | EPOLLHUP,
 			 &d->display_task);
 
@@ -6193,6 +7919,8 @@ display_create(int *argc, char *argv[])
 	wl_list_init(&d->input_list);
 	wl_list_init(&d->output_list);
 	wl_list_init(&d->global_list);
+	wl_list_init(&d->resize_pools);
+	d->presentation_clock = CLOCK_MONOTONIC;
 
 	d->registry = wl_display_get_registry(d->display);
 	wl_registry_add_listener(d->registry, &registry_listener, d);
@@ -6211,12 +7939,17 @@ display_create(int *argc, char *argv[])
 
 	create_cursors(d);
 
+	if (d->shm)
+		d->shm_arena = shm_arena_create(d);
+
 	d->theme = theme_create();
 
 	wl_list_init(&d->window_list);
 
 	init_dummy_surface(d);
 
+	display_init_tracing(d);
+
 	return d;
 }
 
@@ -6243,6 +7976,8 @@ display_destroy_inputs(struct display *display)
 void
 display_destroy(struct display *display)
 {
+	struct shm_pool *pool, *tmp;
+
 	if (!wl_list_empty(&display->window_list))
 		fprintf(stderr, "toytoolkit warning: %d windows exist.\n",
 			wl_list_length(&display->window_list));
@@ -6269,9 +8004,23 @@ display_destroy(struct display *display)
 	if (display->subcompositor)
 		wl_subcompositor_destroy(display->subcompositor);
 
+	if (display->presentation)
+		wp_presentation_destroy(display->presentation);
+
 	if (display->xdg_shell)
 		xdg_wm_base_destroy(display->xdg_shell);
 
+	wl_list_for_each_safe(pool, tmp, &display->resize_pools, link)
+		shm_pool_destroy(pool);
+
+	/* The pool proxy goes with the display; buffers still alive only
+	 * keep the mapping of the arena until they are destroyed */
+	if (display->shm_arena) {
+		wl_shm_pool_destroy(display->shm_arena->pool);
+		display->shm_arena->pool = NULL;
+		shm_arena_unref(display->shm_arena);
+	}
+
 	if (display->shm)
 		wl_shm_destroy(display->shm);
 
@@ -6281,7 +8030,16 @@ display_destroy(struct display *display)
 	wl_compositor_destroy(display->compositor);
 	wl_registry_destroy(display->registry);
 
+	if (display->trace_path) {
+		close(display->trace_signal_fd);
+		free(display->trace_path);
+	}
+
+	if (display->render_pool)
+		render_pool_destroy(display->render_pool);
+
 	close(display->epoll_fd);
+	free(display->epoll_events);
 
 	if (!(display->display_fd_events & EPOLLERR) &&
 	    !(display->display_fd_events & EPOLLHUP))
@@ -6347,6 +8105,26 @@ display_get_serial(struct display *display)
 	return display->serial;
 }
 
+int
+display_set_render_threads(struct display *display, int count)
+{
+	if (display->render_pool) {
+		render_pool_destroy(display->render_pool);
+		display->render_pool = NULL;
+	}
+
+	if (count > 0)
+		display->render_pool = render_pool_create(count);
+
+	return display->render_pool ? display->render_pool->count : 0;
+}
+
+uint32_t
+display_get_buffer_starvation_count(struct display *display)
+{
+	return display->buffer_starvation_count;
+}
+
 EGLDisplay
 display_get_egl_display(struct display *d)
 {
@@ -6417,12 +8195,45 @@ display_unwatch_fd(struct display *display, int fd)
 	epoll_ctl(display->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
 }
 
+/* Time low priority tasks may take per main loop iteration. Tasks that
+ * do not get to run are reported again by the next epoll_wait(). */
+#define LOW_PRIORITY_BUDGET_NSEC (4 * 1000 * 1000)
+
+static void
+display_run_tasks(struct display *display, struct epoll_event *ep, int count)
+{
+	struct task *task;
+	struct timespec start, now;
+	int i, priority;
+
+	for (priority = TASK_PRIORITY_HIGH;
+	     priority <= TASK_PRIORITY_LOW; priority++) {
+		if (priority == TASK_PRIORITY_LOW)
+			clock_gettime(CLOCK_MONOTONIC, &start);
+
+		for (i = 0; i < count; i++) {
+			task = ep[i].data.ptr;
+			if (task->priority != priority)
+				continue;
+
+			if (priority == TASK_PRIORITY_LOW) {
+				clock_gettime(CLOCK_MONOTONIC, &now);
+				if (timespec_sub_to_nsec(&now, &start) >
+				    LOW_PRIORITY_BUDGET_NSEC)
+					return;
+			}
+
+			task->run(task, ep[i].events);
+		}
+	}
+}
+
 void
 display_run(struct display *display)
 {
 	struct task *task;
-	struct epoll_event ep[16];
-	int i, count, ret;
+	struct epoll_event *ep;
+	int count, ret;
 
 	display->running = 1;
 	while (1) {
@@ -6438,6 +8249,7 @@ display_run(struct display *display)
 		if (!display->running)
 			break;
 
+		ep = display->epoll_events;
 		ret = wl_display_flush(display->display);
 		if (ret < 0 && errno == EAGAIN) {
 			ep[0].events =
@@ -6451,10 +8263,18 @@ display_run(struct display *display)
 		}
 
 		count = epoll_wait(display->epoll_fd,
-				   ep, ARRAY_LENGTH(ep), -1);
-		for (i = 0; i < count; i++) {
-			task = ep[i].data.ptr;
-			task->run(task, ep[i].events);
+				   ep, display->epoll_events_size, -1);
+		display_run_tasks(display, ep, count);
+
+		/* A full batch may have left events behind; take more
+		 * of them at once next time. */
+		if (count == display->epoll_events_size &&
+		    display->epoll_events_size < MAX_EPOLL_EVENTS) {
+			display->epoll_events_size *= 2;
+			display->epoll_events =
+				xrealloc(display->epoll_events,
+					 display->epoll_events_size *
+					 sizeof display->epoll_events[0]);
 		}
 	}
 }
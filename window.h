@@ -41,9 +41,18 @@ struct display;
 struct input;
 struct output;
 
+/* Order in which tasks woken by the same epoll_wait() are run. Low
+ * priority tasks get a limited time per main loop iteration. */
+enum task_priority {
+	TASK_PRIORITY_HIGH = -1,	/* display connection, input */
+	TASK_PRIORITY_NORMAL = 0,	/* timers, redraws */
+	TASK_PRIORITY_LOW = 1,		/* bulk I/O */
+};
+
 struct task {
 	void (*run)(struct task *task, uint32_t events);
 	struct wl_list link;
+	enum task_priority priority;
 };
 
 struct rectangle {
@@ -83,6 +92,23 @@ display_get_output(struct display *display);
 uint32_t
 display_get_serial(struct display *display);
 
+/* Number of redraws postponed because the compositor still held every
+ * buffer of the surface being drawn. */
+uint32_t
+display_get_buffer_starvation_count(struct display *display);
+
+/*
+ * Start count worker threads that draw subsurfaces whose widgets are
+ * all marked with widget_set_thread_safe() in parallel; 0 stops them.
+ * Returns the number of threads actually running.
+ */
+int
+display_set_render_threads(struct display *display, int count);
+
+/* Write the traces of all windows as Chrome trace event JSON */
+int
+display_write_trace(struct display *display, const char *filename);
+
 typedef void (*display_global_handler_t)(struct display *display,
 					 uint32_t name,
 					 const char *interface,
@@ -242,6 +268,8 @@ typedef void (*widget_resize_handler_t)(struct widget *widget,
 					int32_t width, int32_t height,
 					void *data);
 typedef void (*widget_redraw_handler_t)(struct widget *widget, void *data);
+typedef void (*widget_prepare_redraw_handler_t)(struct widget *widget,
+						void *data);
 
 typedef int (*widget_enter_handler_t)(struct widget *widget,
 				      struct input *input,
@@ -376,6 +404,28 @@ void
 window_get_allocation(struct window *window, struct rectangle *allocation);
 void
 window_schedule_redraw(struct window *window);
+
+/*
+ * Start redraws margin_usec before the compositor's next refresh, as
+ * predicted from presentation feedback, instead of right away; redraw
+ * requests in between are coalesced into that one redraw. The margin
+ * must cover drawing plus the compositor's own repaint deadline. Zero
+ * (the default) disables pacing, as does a compositor without
+ * wp_presentation.
+ */
+void
+window_set_redraw_margin(struct window *window, int32_t margin_usec);
+
+/*
+ * Timestamp the redraw pipeline of the window (input events, redraw
+ * scheduling, idle redraw, widget redraw, buffer swap and frame
+ * callbacks) into a ring buffer of the most recent events. Setting
+ * TOYTOOLKIT_TRACE to a file name traces all windows and writes the
+ * trace to that file on SIGUSR1; the variable is removed from the
+ * environment, so processes the client starts don't trace.
+ */
+void
+window_set_tracing(struct window *window, int enable);
 void
 window_schedule_resize(struct window *window, int width, int height);
 
@@ -558,9 +608,78 @@ widget_get_last_time(struct widget *widget);
 void
 widget_input_region_add(struct widget *widget, const struct rectangle *rect);
 
+/*
+ * Damage tracking: a widget that calls widget_set_damage_tracking()
+ * promises to report everything it changes with widget_damage_region(),
+ * either from its redraw handler or before scheduling the redraw.
+ * The rectangle is in the same coordinates as the widget allocation,
+ * NULL damages the whole allocation. The surface is damaged completely
+ * whenever a widget without damage tracking is redrawn.
+ * When all widgets of a surface track damage, shm buffers are reused
+ * with their previous contents and widget_cairo_create() clips drawing
+ * to the damage. Damage reported after the first widget of the surface
+ * has created its context costs a second, unclipped pass, so widgets
+ * nested in others report it from their prepare redraw handler.
+ */
+void
+widget_set_damage_tracking(struct widget *widget, int tracking);
+
+void
+widget_damage_region(struct widget *widget, const struct rectangle *rect);
+
+/*
+ * For damage tracking widgets: move the contents of rect down by dy
+ * (up when negative) within the buffer about to be drawn, instead of
+ * redrawing them. Only valid before any widget of the surface has
+ * called widget_cairo_create(), so call it from the prepare redraw
+ * handler; in a decorated window the frame draws first. The moved
+ * area reaches the compositor without being redrawn; the uncovered
+ * part still has to be damaged and drawn. Returns 0 if the buffer
+ * can't be reused this way, the whole rectangle has to be redrawn
+ * then.
+ */
+int
+widget_scroll_region(struct widget *widget, const struct rectangle *rect,
+		     int dy);
+
+/*
+ * Limit the number of shm buffers the widget's surface may cycle
+ * through, between 2 and 8 (default 3). Extra buffers are only
+ * allocated while the compositor holds all others; once the limit is
+ * reached the redraw waits for a buffer to be released.
+ */
+void
+widget_set_max_buffers(struct widget *widget, int count);
+
+/*
+ * Declare that the redraw handler only draws into the widget's own
+ * surface, without touching other widgets or making Wayland requests,
+ * so it may run on a render thread. It may still schedule a redraw of
+ * its own widget, which then happens on the next frame callback.
+ */
+void
+widget_set_thread_safe(struct widget *widget, int thread_safe);
+
+/*
+ * With render threads running, call the redraw handler concurrently
+ * for horizontal bands of the buffer; widget_cairo_create() then
+ * returns a context that only reaches the current band. The handler
+ * must be reentrant: draw everything through widget_cairo_create()
+ * and leave shared state untouched.
+ */
+void
+widget_set_tiled_redraw(struct widget *widget, int tiled);
+
 void
 widget_set_redraw_handler(struct widget *widget,
 			  widget_redraw_handler_t handler);
+/*
+ * Called on the main thread for every redraw of the widget's surface,
+ * once its buffer is known and before any widget of it draws.
+ */
+void
+widget_set_prepare_redraw_handler(struct widget *widget,
+				  widget_prepare_redraw_handler_t handler);
 void
 widget_set_resize_handler(struct widget *widget,
 			  widget_resize_handler_t handler);